@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "cache-control.h"
+
+#define HEADER_CACHE_CONTROL "Cache-Control"
+#define HEADER_EXPIRES "Expires"
+#define HEADER_DATE "Date"
+#define HEADER_AGE "Age"
+#define HEADER_LAST_MODIFIED "Last-Modified"
+#define HEADER_ETAG "ETag"
+
+// Larger delta-seconds values are replaced by this one (RFC 9111 1.2.2)
+#define MAX_DELTA_SECONDS 2147483648L
+// Heuristic lifetime is fraction of time since last modification
+#define HEURISTIC_FRACTION 10
+#define HEURISTIC_MAX_LIFETIME (24 * 60 * 60)
+
+static const cache_freshness_t default_freshness = {0, 0, 0, 0, false};
+
+// Preferred format goes first, others are obsolete
+static const char* http_date_formats[] = {
+    "%a, %d %b %Y %H:%M:%S GMT",  // Sun, 06 Nov 1994 08:49:37 GMT
+    "%A, %d-%b-%y %H:%M:%S GMT",  // Sunday, 06-Nov-94 08:49:37 GMT
+    "%a %b %e %H:%M:%S %Y",       // Sun Nov  6 08:49:37 1994
+};
+
+void cache_control_init(cache_control_t* control) {
+  control->date = control->expires = control->last_modified = -1;
+  control->etag = control->last_modified_header = NULL;
+  control->age = 0;
+  control->max_age = control->shared_max_age = -1;
+  control->stale_while_revalidate = control->stale_if_error = -1;
+  control->has_expires = false;
+  control->no_store = control->no_cache = control->is_private = false;
+  control->must_revalidate = false;
+}
+
+static const char* skip_spaces(const char* str) {
+  while (*str == ' ' || *str == '\t')
+    str++;
+  return str;
+}
+
+/**
+ * Parses HTTP-date in any of allowed formats.
+ *
+ * @return Parsed time or {@code -1} if date is invalid.
+ */
+static time_t parse_http_date(const char* value) {
+  struct tm tm;
+
+  value = skip_spaces(value);
+  for (size_t i = 0; i < sizeof(http_date_formats) / sizeof(char*); i++) {
+    memset(&tm, 0, sizeof(struct tm));
+    const char* end = strptime(value, http_date_formats[i], &tm);
+    if (end != NULL && *skip_spaces(end) == '\0')
+      return timegm(&tm);
+  }
+
+  return -1;
+}
+
+/**
+ * Replaces stored header value.
+ * Value is dropped, if there is not enough memory.
+ */
+static void store_value(char** target, const char* value) {
+  free(*target);
+  (*target) = strdup(skip_spaces(value));
+}
+
+/**
+ * Parses delta-seconds value, which can be quoted.
+ * Invalid value is treated as zero, so response is considered stale.
+ *
+ * @return Amount of seconds.
+ */
+static long parse_seconds(const char* value, size_t len) {
+  long result = 0;
+
+  if (len >= 2 && value[0] == '"' && value[len - 1] == '"') {
+    value++;
+    len -= 2;
+  }
+
+  for (size_t i = 0; i < len; i++) {
+    if (value[i] < '0' || value[i] > '9')
+      return 0;
+    if (result < MAX_DELTA_SECONDS)
+      result = result * 10 + (value[i] - '0');
+  }
+
+  return result < MAX_DELTA_SECONDS ? result : MAX_DELTA_SECONDS;
+}
+
+/**
+ * @return {@code true} if directive has required name.
+ */
+static bool is_directive(const char* name, size_t len, const char* expected) {
+  return strlen(expected) == len && !strncasecmp(name, expected, len);
+}
+
+/**
+ * Applies single Cache-Control directive.
+ * Qualified no-cache and private forms are applied to whole response.
+ */
+static void apply_directive(cache_control_t* control,
+                           const char* name,
+                           size_t name_len,
+                           const char* arg,
+                           size_t arg_len) {
+  if (is_directive(name, name_len, "no-store"))
+    control->no_store = true;
+  else if (is_directive(name, name_len, "no-cache"))
+    control->no_cache = true;
+  else if (is_directive(name, name_len, "private"))
+    control->is_private = true;
+  else if (is_directive(name, name_len, "max-age"))
+    control->max_age = parse_seconds(arg, arg_len);
+  else if (is_directive(name, name_len, "s-maxage"))
+    control->shared_max_age = parse_seconds(arg, arg_len);
+  else if (is_directive(name, name_len, "must-revalidate") ||
+           is_directive(name, name_len, "proxy-revalidate"))
+    control->must_revalidate = true;
+  else if (is_directive(name, name_len, "stale-while-revalidate"))
+    control->stale_while_revalidate = parse_seconds(arg, arg_len);
+  else if (is_directive(name, name_len, "stale-if-error"))
+    control->stale_if_error = parse_seconds(arg, arg_len);
+}
+
+/**
+ * Parses comma separated Cache-Control directives.
+ *
+ * no-cache, max-age=60, private="Set-Cookie"
+ */
+static void parse_directives(cache_control_t* control, const char* value) {
+  const char* pos = value;
+
+  while (*pos != '\0') {
+    const char* name = pos = skip_spaces(pos);
+    while (*pos != '\0' && *pos != '=' && *pos != ',' && *pos != ' ' &&
+           *pos != '\t')
+      pos++;
+    size_t name_len = pos - name;
+
+    const char* arg = NULL;
+    size_t arg_len = 0;
+    pos = skip_spaces(pos);
+    if (*pos == '=') {
+      arg = pos = skip_spaces(pos + 1);
+      // Quoted argument can contain commas
+      if (*pos == '"') {
+        pos = strchr(pos + 1, '"');
+        pos = pos != NULL ? pos + 1 : arg + strlen(arg);
+      } else {
+        while (*pos != '\0' && *pos != ',' && *pos != ' ' && *pos != '\t')
+          pos++;
+      }
+      arg_len = pos - arg;
+    }
+
+    if (name_len > 0)
+      apply_directive(control, name, name_len, arg, arg_len);
+
+    while (*pos != '\0' && *pos++ != ',')
+      ;
+  }
+}
+
+void cache_control_parse_header(cache_control_t* control,
+                                const char* key,
+                                const char* value) {
+  if (!strcasecmp(key, HEADER_CACHE_CONTROL)) {
+    parse_directives(control, value);
+  } else if (!strcasecmp(key, HEADER_EXPIRES)) {
+    // Invalid date means already expired response
+    control->has_expires = true;
+    control->expires = parse_http_date(value);
+  } else if (!strcasecmp(key, HEADER_DATE)) {
+    control->date = parse_http_date(value);
+  } else if (!strcasecmp(key, HEADER_AGE)) {
+    value = skip_spaces(value);
+    control->age = parse_seconds(value, strcspn(value, " \t"));
+  } else if (!strcasecmp(key, HEADER_LAST_MODIFIED)) {
+    control->last_modified = parse_http_date(value);
+    store_value(&control->last_modified_header, value);
+  } else if (!strcasecmp(key, HEADER_ETAG)) {
+    store_value(&control->etag, value);
+  }
+}
+
+bool cache_control_storable(cache_control_t* control) {
+  // Private responses are stored only by user agents
+  return !control->no_store && !control->is_private;
+}
+
+/**
+ * Estimates freshness lifetime of response without explicit one.
+ * Response changed long ago will hardly change soon.
+ *
+ * @return Lifetime in seconds.
+ */
+static long heuristic_lifetime(long unmodified) {
+  long lifetime = unmodified / HEURISTIC_FRACTION;
+
+  return lifetime < HEURISTIC_MAX_LIFETIME ? lifetime : HEURISTIC_MAX_LIFETIME;
+}
+
+/**
+ * Checks, if response has explicit freshness lifetime.
+ */
+static bool has_lifetime(cache_control_t* control) {
+  return control->no_cache || control->shared_max_age != -1 ||
+         control->max_age != -1 || control->has_expires;
+}
+
+/**
+ * @return Response freshness lifetime in seconds.
+ */
+static long compute_lifetime(cache_control_t* control, time_t date) {
+  if (control->no_cache)
+    return 0;
+  else if (control->shared_max_age != -1)
+    return control->shared_max_age;
+  else if (control->max_age != -1)
+    return control->max_age;
+  else if (control->has_expires)
+    return control->expires > date ? control->expires - date : 0;
+  else if (control->last_modified != -1 && control->last_modified < date)
+    return heuristic_lifetime(date - control->last_modified);
+
+  return 0;
+}
+
+void cache_control_freshness(cache_control_t* control,
+                             time_t response_time,
+                             const cache_freshness_t* stored,
+                             cache_freshness_t* freshness) {
+  time_t date = control->date != -1 ? control->date : response_time;
+
+  if (stored != NULL && !has_lifetime(control))
+    freshness->lifetime = stored->lifetime;
+  else
+    freshness->lifetime = compute_lifetime(control, date);
+
+  // Response could wait in other caches before
+  long age = response_time > date ? response_time - date : 0;
+  if (control->age > age)
+    age = control->age;
+  freshness->expires = response_time - age + freshness->lifetime;
+
+  // Not modified response replaces only directives it has
+  const cache_freshness_t* base = stored != NULL ? stored : &default_freshness;
+  freshness->stale_while_revalidate = control->stale_while_revalidate != -1
+                                          ? control->stale_while_revalidate
+                                          : base->stale_while_revalidate;
+  freshness->stale_if_error = control->stale_if_error != -1
+                                  ? control->stale_if_error
+                                  : base->stale_if_error;
+
+  // Shared cache must revalidate responses with s-maxage
+  freshness->must_revalidate = control->must_revalidate || control->no_cache ||
+                               control->shared_max_age != -1 ||
+                               base->must_revalidate;
+}
+
+void cache_control_free(cache_control_t* control) {
+  free(control->etag);
+  free(control->last_modified_header);
+  control->etag = control->last_modified_header = NULL;
+}
@@ -0,0 +1,88 @@
+#include <stdbool.h>
+#include <time.h>
+
+#ifndef _CACHE_CONTROL_H
+#define _CACHE_CONTROL_H
+
+typedef struct cache_control {
+  time_t date;
+  time_t expires;
+  time_t last_modified;
+  char* etag;
+  char* last_modified_header;
+  long age;
+  long max_age;
+  long shared_max_age;
+  long stale_while_revalidate;
+  long stale_if_error;
+  bool has_expires;
+  bool no_store;
+  bool no_cache;
+  bool is_private;
+  bool must_revalidate;
+} cache_control_t;
+
+typedef struct cache_freshness {
+  time_t expires;
+  long lifetime;
+  long stale_while_revalidate;
+  long stale_if_error;
+  bool must_revalidate;
+} cache_freshness_t;
+
+/**
+ * Initializes response caching headers without any values.
+ *
+ * @param control Target caching headers.
+ */
+void cache_control_init(cache_control_t* control);
+
+/**
+ * Parses response header, if it affects caching.
+ * Cache-Control directives of several headers are merged.
+ * ETag and Last-Modified values are kept for revalidation.
+ *
+ * @param control Target caching headers.
+ * @param key Zero-ended header name.
+ * @param value Zero-ended header value.
+ */
+void cache_control_parse_header(cache_control_t* control,
+                                const char* key,
+                                const char* value);
+
+/**
+ * Checks, if response can be stored by shared cache.
+ *
+ * @param control Response caching headers.
+ *
+ * @return {@code true} if response can be stored.
+ */
+bool cache_control_storable(cache_control_t* control);
+
+/**
+ * Computes response freshness.
+ * Lifetime is taken from s-maxage, max-age or Expires, otherwise it is
+ * estimated from Last-Modified. Response age, reported by Age or seen
+ * from Date, is subtracted from lifetime. Stale response can be used
+ * for stale-while-revalidate seconds during revalidation and for
+ * stale-if-error seconds, if revalidation fails.
+ * Stored freshness fills values missing in not modified response.
+ *
+ * @param control Response caching headers.
+ * @param response_time Time of response receiving.
+ * @param stored Freshness of stored response or {@code NULL}.
+ * @param freshness Computed freshness.
+ */
+void cache_control_freshness(cache_control_t* control,
+                             time_t response_time,
+                             const cache_freshness_t* stored,
+                             cache_freshness_t* freshness);
+
+/**
+ * Frees stored response validators.
+ *
+ * @param control Target caching headers.
+ */
+void cache_control_free(cache_control_t* control);
+
+#endif
@@ -0,0 +1,359 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache-journal.h"
+
+#define JOURNAL_NAME "index"
+#define JOURNAL_TEMP_NAME "index.tmp"
+// Enough for record type, numbers and delimiters
+#define JOURNAL_RECORD_PREFIX_LEN 128
+#define JOURNAL_PRE_SIZE 64
+// Number, length, freshness, URL and validators
+#define RECORD_ADD_FORMAT "+ %zu %zu %lld %ld %ld %ld %d %s\t%s\t%s\n"
+#define JOURNAL_GROW_SPEED 2
+
+/**
+ * Allocates "<directory>/<name>" path.
+ *
+ * @return Path or {@code NULL}.
+ */
+static char* make_path(const char* directory, const char* name) {
+  size_t len = strlen(directory) + strlen(name) + 2;
+  char* path = (char*)malloc(len);
+
+  if (path != NULL)
+    snprintf(path, len, "%s/%s", directory, name);
+
+  return path;
+}
+
+static int compare_numbers(const void* a, const void* b) {
+  size_t first = *(const size_t*)a;
+  size_t second = *(const size_t*)b;
+
+  return first < second ? -1 : first > second;
+}
+
+/**
+ * Appends item to growing array.
+ *
+ * @return {@code true} if success.
+ */
+static bool array_push(void** array,
+                       size_t* count,
+                       size_t* size,
+                       size_t item_size,
+                       const void* item) {
+  if (*count >= *size) {
+    size_t new_size = *size ? *size * JOURNAL_GROW_SPEED : JOURNAL_PRE_SIZE;
+    void* temp = realloc(*array, new_size * item_size);
+    if (temp == NULL)
+      return false;
+    (*array) = temp;
+    (*size) = new_size;
+  }
+
+  memcpy((char*)*array + (*count)++ * item_size, item, item_size);
+  return true;
+}
+
+/**
+ * Frees strings of record.
+ */
+static void record_free(cache_journal_record_t* record) {
+  free(record->url);
+  free(record->etag);
+  free(record->last_modified);
+}
+
+/**
+ * Extracts next tab separated string of record.
+ * Empty and missing strings are {@code NULL}.
+ *
+ * @return {@code false} if not enough memory.
+ */
+static bool next_field(const char** str, char** field) {
+  (*field) = NULL;
+  if (*str == NULL)
+    return true;
+
+  size_t len = strcspn(*str, "\t");
+  if (len > 0 && ((*field) = strndup(*str, len)) == NULL)
+    return false;
+
+  (*str) = (*str)[len] == '\t' ? *str + len + 1 : NULL;
+  return true;
+}
+
+/**
+ * Replays journal file.
+ * Incomplete last record, left by crash, is ignored.
+ *
+ * @return {@code 0} if success or error code.
+ */
+static int replay_journal(const char* path,
+                          cache_journal_record_t** result,
+                          size_t* result_count) {
+  cache_journal_record_t* records = NULL;
+  size_t records_count = 0, records_size = 0;
+  size_t* removed = NULL;
+  size_t removed_count = 0, removed_size = 0;
+  cache_journal_record_t record;
+  cache_freshness_t* freshness = &record.freshness;
+  const char* fields;
+  long long expires;
+  int must_revalidate;
+  char* line = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+  int pos, error = 0;
+
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    (*result) = NULL;
+    (*result_count) = 0;
+    return errno == ENOENT ? 0 : errno;
+  }
+
+  while ((len = getline(&line, &line_size, file)) != -1) {
+    if (len == 0 || line[len - 1] != '\n')
+      break;
+    line[len - 1] = '\0';
+
+    if (sscanf(line, "+ %zu %zu %lld %ld %ld %ld %d %n", &record.number,
+               &record.len, &expires, &freshness->lifetime,
+               &freshness->stale_while_revalidate, &freshness->stale_if_error,
+               &must_revalidate, &pos) == 7 &&
+        line[pos] != '\0') {
+      freshness->expires = (time_t)expires;
+      freshness->must_revalidate = must_revalidate;
+      record.url = record.etag = record.last_modified = NULL;
+      fields = line + pos;
+      if (!next_field(&fields, &record.url) ||
+          !next_field(&fields, &record.etag) ||
+          !next_field(&fields, &record.last_modified) ||
+          !array_push((void**)&records, &records_count, &records_size,
+                      sizeof(cache_journal_record_t), &record)) {
+        record_free(&record);
+        error = ENOMEM;
+        break;
+      }
+    } else if (sscanf(line, "- %zu", &record.number) == 1) {
+      if (!array_push((void**)&removed, &removed_count, &removed_size,
+                      sizeof(size_t), &record.number)) {
+        error = ENOMEM;
+        break;
+      }
+    }
+  }
+
+  free(line);
+  fclose(file);
+
+  if (error) {
+    free(removed);
+    cache_journal_records_free(records, records_count);
+    return error;
+  }
+
+  // Record number is its first field, so records are compared as numbers
+  qsort(records, records_count, sizeof(cache_journal_record_t),
+        &compare_numbers);
+  qsort(removed, removed_count, sizeof(size_t), &compare_numbers);
+
+  size_t live = 0;
+  for (size_t i = 0; i < records_count; i++) {
+    if (bsearch(&records[i].number, removed, removed_count, sizeof(size_t),
+                &compare_numbers) != NULL) {
+      record_free(&records[i]);
+      continue;
+    }
+    records[live++] = records[i];
+  }
+  free(removed);
+
+  (*result) = records;
+  (*result_count) = live;
+  return 0;
+}
+
+/**
+ * Rewrites journal with live records only.
+ *
+ * @return {@code 0} if success or error code.
+ */
+static int compact_journal(const char* directory,
+                           const char* path,
+                           cache_journal_record_t* records,
+                           size_t count) {
+  int error = 0;
+
+  char* temp_path = make_path(directory, JOURNAL_TEMP_NAME);
+  if (temp_path == NULL)
+    return errno;
+
+  FILE* file = fopen(temp_path, "w");
+  if (file == NULL) {
+    error = errno;
+    free(temp_path);
+    return error;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    cache_freshness_t* freshness = &records[i].freshness;
+    fprintf(file, RECORD_ADD_FORMAT, records[i].number, records[i].len,
+            (long long)freshness->expires, freshness->lifetime,
+            freshness->stale_while_revalidate, freshness->stale_if_error,
+            freshness->must_revalidate, records[i].url,
+            records[i].etag != NULL ? records[i].etag : "",
+            records[i].last_modified != NULL ? records[i].last_modified : "");
+  }
+
+  if (fflush(file) || fsync(fileno(file)))
+    error = errno;
+  fclose(file);
+
+  // Journal is replaced atomically
+  if (!error && rename(temp_path, path))
+    error = errno;
+  if (error)
+    unlink(temp_path);
+
+  free(temp_path);
+  return error;
+}
+
+/**
+ * Removes cache files not mentioned by live records.
+ */
+static void remove_unknown_files(const char* directory,
+                                 cache_journal_record_t* records,
+                                 size_t count) {
+  struct dirent* item;
+  size_t number;
+  int pos;
+
+  DIR* dir = opendir(directory);
+  if (dir == NULL) {
+    perror("Cannot scan cache directory");
+    return;
+  }
+
+  while ((item = readdir(dir)) != NULL) {
+    // Other files are not touched
+    if (sscanf(item->d_name, "%*[0-9a-f]-%zu%n", &number, &pos) != 1 ||
+        item->d_name[pos] != '\0')
+      continue;
+
+    if (bsearch(&number, records, count, sizeof(cache_journal_record_t),
+                &compare_numbers) != NULL)
+      continue;
+
+    char* path = make_path(directory, item->d_name);
+    if (path != NULL) {
+      unlink(path);
+      free(path);
+    }
+  }
+
+  closedir(dir);
+}
+
+int cache_journal_open(cache_journal_t* journal,
+                       const char* directory,
+                       cache_journal_record_t** records,
+                       size_t* count) {
+  int error;
+
+  journal->path = make_path(directory, JOURNAL_NAME);
+  if (journal->path == NULL)
+    return errno;
+
+  error = replay_journal(journal->path, records, count);
+  if (error)
+    goto error_replay;
+
+  error = compact_journal(directory, journal->path, *records, *count);
+  if (error)
+    goto error_compact;
+
+  remove_unknown_files(directory, *records, *count);
+
+  journal->fd =
+      open(journal->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (journal->fd == -1) {
+    error = errno;
+    goto error_compact;
+  }
+
+  return 0;
+
+error_compact:
+  cache_journal_records_free(*records, *count);
+error_replay:
+  free(journal->path);
+  journal->path = NULL;
+  return error;
+}
+
+/**
+ * Appends record to journal.
+ * Record is written by single call, so concurrent records are not mixed.
+ */
+static void write_record(cache_journal_t* journal,
+                         const char* record,
+                         int len) {
+  if (len < 0 || write(journal->fd, record, len) != len)
+    perror("Cannot write cache journal");
+}
+
+void cache_journal_add(cache_journal_t* journal,
+                       const cache_journal_record_t* record) {
+  const cache_freshness_t* freshness = &record->freshness;
+  const char* etag = record->etag != NULL ? record->etag : "";
+  const char* last_modified =
+      record->last_modified != NULL ? record->last_modified : "";
+  size_t size = strlen(record->url) + strlen(etag) + strlen(last_modified) +
+                JOURNAL_RECORD_PREFIX_LEN;
+
+  char* line = (char*)malloc(size);
+  if (line == NULL) {
+    perror("Cannot write cache journal");
+    return;
+  }
+
+  write_record(journal, line,
+               snprintf(line, size, RECORD_ADD_FORMAT, record->number,
+                        record->len, (long long)freshness->expires,
+                        freshness->lifetime, freshness->stale_while_revalidate,
+                        freshness->stale_if_error, freshness->must_revalidate,
+                        record->url, etag, last_modified));
+  free(line);
+}
+
+void cache_journal_remove(cache_journal_t* journal, size_t number) {
+  char record[JOURNAL_RECORD_PREFIX_LEN];
+
+  write_record(journal, record,
+               snprintf(record, sizeof(record), "- %zu\n", number));
+}
+
+void cache_journal_records_free(cache_journal_record_t* records, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    record_free(&records[i]);
+  free(records);
+}
+
+void cache_journal_close(cache_journal_t* journal) {
+  if (journal->path == NULL)
+    return;
+
+  close(journal->fd);
+  free(journal->path);
+  journal->path = NULL;
+}
@@ -0,0 +1,75 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "cache-control.h"
+
+#ifndef _CACHE_JOURNAL_H
+#define _CACHE_JOURNAL_H
+
+typedef struct cache_journal {
+  int fd;
+  char* path;
+} cache_journal_t;
+
+typedef struct cache_journal_record {
+  size_t number;
+  size_t len;
+  cache_freshness_t freshness;
+  char* url;
+  char* etag;
+  char* last_modified;
+} cache_journal_record_t;
+
+/**
+ * Opens cache files journal in cache directory.
+ * Journal is replayed and rewritten with live records only.
+ * Cache files not mentioned by live records are removed.
+ * Cache files are named "<hash>-<number>".
+ *
+ * @param journal Opened journal.
+ * @param directory Cache directory.
+ * @param records Live records sorted by file number, must be freed.
+ * @param count Amount of live records.
+ *
+ * @return {@code 0} if success or error code.
+ */
+int cache_journal_open(cache_journal_t* journal,
+                       const char* directory,
+                       cache_journal_record_t** records,
+                       size_t* count);
+
+/**
+ * Appends record about created cache file.
+ * Validators of record can be {@code NULL}.
+ *
+ * @param journal Target journal.
+ * @param record Cache file number, length, cached response freshness,
+ * URL and validators.
+ */
+void cache_journal_add(cache_journal_t* journal,
+                       const cache_journal_record_t* record);
+
+/**
+ * Appends record about removed cache file.
+ *
+ * @param journal Target journal.
+ * @param number Cache file number.
+ */
+void cache_journal_remove(cache_journal_t* journal, size_t number);
+
+/**
+ * Frees records returned by journal opening.
+ *
+ * @param records Target records.
+ * @param count Amount of records.
+ */
+void cache_journal_records_free(cache_journal_record_t* records, size_t count);
+
+/**
+ * Closes journal.
+ *
+ * @param journal Target journal.
+ */
+void cache_journal_close(cache_journal_t* journal);
+
+#endif
@@ -1,70 +1,296 @@
 
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "proxy-utils.h"
 
 #include "cache.h"
 
+// Amount of independently locked index parts, must be power of two
+#define CACHE_STRIPES_BITS 6
+#define CACHE_STRIPES (1 << CACHE_STRIPES_BITS)
+#define CACHE_PRE_BUCKETS 16
+#define CACHE_GROW_SPEED 2
+// Maximum average amount of entries per bucket
+#define CACHE_LOAD_FACTOR 1
+#define CACHE_PRE_SEGMENTS 4
+#define CACHE_SEGMENTS_GROW_SPEED 2
+
+// Admission window and protected main part sizes
+#define CACHE_WINDOW_PERCENT 1
+#define CACHE_PROTECTED_PERCENT 80
+// Expected entry size for frequency sketch sizing
+#define CACHE_AVERAGE_ENTRY_SIZE (16 * 1024)
+// Cache file name: "/<hash>-<number>"
+#define CACHE_FILE_NAME_LEN 48
+
+
 static cache_t cache;
 
-int cache_init(void) {
-  cache.list = NULL;
-  return pthread_mutex_init(&cache.global_lock, NULL);
+/**
+ * Destroys index stripe, but not entries linked to it.
+ */
+static void stripe_destroy(cache_stripe_t* stripe) {
+  pthread_rwlock_destroy(&stripe->lock);
+  free(stripe->buckets);
 }
 
-int cache_find_or_create(char* url, cache_entry_t** result) {
+/**
+ * Initializes empty index stripe.
+ *
+ * @return {@code 0} if success or error code.
+ */
+static int stripe_init(cache_stripe_t* stripe) {
   int error;
 
-  if (url == NULL)
-    return -1;
+  stripe->entries_count = 0;
+  stripe->buckets_count = CACHE_PRE_BUCKETS;
+  stripe->buckets =
+      (cache_entry_t**)calloc(stripe->buckets_count, sizeof(cache_entry_t*));
+  if (stripe->buckets == NULL)
+    return errno;
+
+  error = pthread_rwlock_init(&stripe->lock, NULL);
+  if (error)
+    free(stripe->buckets);
+
+  return error;
+}
+
+/**
+ * Initializes empty policy region.
+ */
+static void region_init(cache_region_t* region, size_t capacity) {
+  region->hand = NULL;
+  region->count = region->size = 0;
+  region->capacity = capacity;
+}
+
+static int load_files(void);
+
+int cache_init(size_t capacity, const char* directory, size_t disk_capacity) {
+  int error;
+
+  cache.capacity = capacity;
+  cache.size = cache.evictions = cache.evicted_bytes = cache.rejections = 0;
+  cache.spills = cache.files_count = cache.spilling = 0;
+  region_init(&cache.disk, disk_capacity);
+
+  cache.directory = NULL;
+  cache.journal.path = NULL;
+  if (directory != NULL) {
+    if (mkdir(directory, 0700) && errno != EEXIST)
+      return errno;
+    cache.directory = strdup(directory);
+    if (cache.directory == NULL)
+      return errno;
+  }
 
-  error = pthread_mutex_lock(&cache.global_lock);
+  size_t window = capacity / 100 * CACHE_WINDOW_PERCENT;
+  size_t main = capacity - window;
+  region_init(&cache.window, window);
+  region_init(&cache.probation, main);
+  region_init(&cache.protected, main / 100 * CACHE_PROTECTED_PERCENT);
+
+  error = pthread_mutex_init(&cache.policy_lock, NULL);
   if (error) {
-    proxy_error(error, "Cannot lock global cache");
+    free(cache.directory);
     return error;
   }
 
-  cache_entry_t* entry = cache.list;
-  cache_entry_t* prev = NULL;
+  error = frequency_sketch_init(&cache.sketch,
+                                capacity / CACHE_AVERAGE_ENTRY_SIZE);
+  if (error)
+    goto error_sketch;
 
-  while (entry) {
-    // Found invalid cache entry
-    if (entry->invalid) {
-      // If no readers, delete it
-      if (entry->readers == NULL && entry->finished) {
-        free(entry->url);
-        pthread_rwlock_destroy(&entry->lock);
-        pstring_free(&entry->data);
-        if (prev == NULL)
-          cache.list = entry->next;
-        else
-          prev->next = entry->next;
-        free(entry);
-        entry = prev == NULL ? cache.list : prev->next;
-      } else {
-        prev = entry;
-        entry = entry->next;
-      }
-      continue;
+  cache.stripes =
+      (cache_stripe_t*)calloc(CACHE_STRIPES, sizeof(cache_stripe_t));
+  if (cache.stripes == NULL) {
+    error = errno;
+    goto error_stripes;
+  }
+
+  for (size_t i = 0; i < CACHE_STRIPES; i++) {
+    error = stripe_init(&cache.stripes[i]);
+    if (error) {
+      while (i-- > 0)
+        stripe_destroy(&cache.stripes[i]);
+      free(cache.stripes);
+      cache.stripes = NULL;
+      goto error_stripes;
     }
+  }
 
-    if (!strcmp(url, entry->url)) {
-      (*result) = entry;
-      pthread_mutex_unlock(&cache.global_lock);
-      return 0;
+  if (cache.directory != NULL) {
+    error = load_files();
+    if (error) {
+      for (size_t i = 0; i < CACHE_STRIPES; i++)
+        stripe_destroy(&cache.stripes[i]);
+      free(cache.stripes);
+      cache.stripes = NULL;
+      goto error_stripes;
+    }
+  }
+
+  return 0;
+
+error_stripes:
+  frequency_sketch_free(&cache.sketch);
+error_sketch:
+  pthread_mutex_destroy(&cache.policy_lock);
+  free(cache.directory);
+  cache.directory = NULL;
+  return error;
+}
+
+void cache_get_stats(cache_stats_t* stats) {
+  stats->capacity = cache.capacity;
+  stats->size = __atomic_load_n(&cache.size, __ATOMIC_RELAXED);
+  stats->evictions = __atomic_load_n(&cache.evictions, __ATOMIC_RELAXED);
+  stats->evicted_bytes =
+      __atomic_load_n(&cache.evicted_bytes, __ATOMIC_RELAXED);
+  stats->rejections = __atomic_load_n(&cache.rejections, __ATOMIC_RELAXED);
+  stats->spills = __atomic_load_n(&cache.spills, __ATOMIC_RELAXED);
+  stats->disk_capacity = cache.disk.capacity;
+  stats->disk_size = __atomic_load_n(&cache.disk.size, __ATOMIC_RELAXED);
+}
+
+/**
+ * @return Index stripe for entry hash. Stripe uses high hash bits,
+ * buckets of stripe use low ones.
+ */
+static cache_stripe_t* stripe_of(uint64_t hash) {
+  return &cache.stripes[hash >> (64 - CACHE_STRIPES_BITS)];
+}
+
+/**
+ * @return Head of bucket chain for entry hash.
+ */
+static cache_entry_t** bucket_of(cache_stripe_t* stripe, uint64_t hash) {
+  return &stripe->buckets[hash & (stripe->buckets_count - 1)];
+}
+
+static void readers_free(cache_entry_reader_t* readers) {
+  cache_entry_reader_t* curr = readers;
+  while (curr) {
+    readers = curr->next;
+    free(curr);
+    curr = readers;
+  }
+}
+
+/**
+ * Releases entry memory segments.
+ */
+static void segments_free(cache_entry_t* entry) {
+  for (size_t i = 0; i < entry->segments_count; i++)
+    cache_segment_release(entry->segments->items[i]);
+  while (entry->segments) {
+    cache_segments_t* retired = entry->segments->retired;
+    free(entry->segments);
+    entry->segments = retired;
+  }
+  entry->segments_count = 0;
+}
+
+/**
+ * Frees entry, which is not referenced by index.
+ * Entry file is removed too.
+ */
+static void entry_free(cache_entry_t* entry) {
+  // Data of entry moved to file is not kept in memory
+  if (entry->segments_count > 0)
+    __atomic_sub_fetch(&cache.size, entry->len, __ATOMIC_RELAXED);
+  readers_free(entry->readers);
+  free(entry->url);
+  pthread_rwlock_destroy(&entry->lock);
+  segments_free(entry);
+  if (entry->mapping != NULL)
+    cache_segment_release(entry->mapping);
+  if (entry->file_name != NULL) {
+    unlink(entry->file_name);
+    cache_journal_remove(&cache.journal, entry->file_number);
+    free(entry->file_name);
+  }
+  free(entry->etag);
+  free(entry->last_modified);
+  cache_entry_release(entry->stale);
+  free(entry);
+}
+
+/**
+ * Doubles amount of stripe buckets and rehashes its entries.
+ * Must be called with stripe write lock held.
+ * Stripe keeps old buckets on allocation failure.
+ */
+static void grow_buckets(cache_stripe_t* stripe) {
+  size_t count = stripe->buckets_count * CACHE_GROW_SPEED;
+  cache_entry_t** buckets =
+      (cache_entry_t**)calloc(count, sizeof(cache_entry_t*));
+  if (buckets == NULL) {
+    perror("Cannot grow cache index");
+    return;
+  }
+
+  for (size_t i = 0; i < stripe->buckets_count; i++) {
+    cache_entry_t* entry = stripe->buckets[i];
+    while (entry) {
+      cache_entry_t* next = entry->next;
+      size_t pos = entry->hash & (count - 1);
+      entry->next = buckets[pos];
+      buckets[pos] = entry;
+      entry = next;
     }
+  }
 
-    prev = entry;
+  free(stripe->buckets);
+  stripe->buckets = buckets;
+  stripe->buckets_count = count;
+}
+
+/**
+ * Searches valid entry in stripe and references it.
+ * Must be called with stripe lock held.
+ *
+ * @return Found entry or {@code NULL}.
+ */
+static cache_entry_t* find_entry(cache_stripe_t* stripe,
+                                 const char* url,
+                                 uint64_t hash) {
+  cache_entry_t* entry = *bucket_of(stripe, hash);
+
+  while (entry) {
+    if (!entry->invalid && entry->hash == hash && !strcmp(url, entry->url)) {
+      __atomic_store_n(&entry->referenced, true, __ATOMIC_RELAXED);
+      cache_entry_retain(entry);
+      return entry;
+    }
     entry = entry->next;
   }
 
-  entry = (cache_entry_t*)malloc(sizeof(cache_entry_t));
+  return NULL;
+}
+
+/**
+ * Allocates new entry referenced by index and caller.
+ *
+ * @return Created entry or {@code NULL}.
+ */
+static cache_entry_t* create_entry(const char* url, uint64_t hash) {
+  int error;
+
+  cache_entry_t* entry = (cache_entry_t*)malloc(sizeof(cache_entry_t));
   if (entry == NULL) {
     perror("Cannot create cache entry");
-    pthread_mutex_unlock(&cache.global_lock);
-    return -1;
+    return NULL;
   }
 
   memset(entry, 0, sizeof(cache_entry_t));
@@ -72,27 +298,638 @@ int cache_find_or_create(char* url, cache_entry_t** result) {
   if (error) {
     proxy_error(error, "Cannot init rw lock for cache entry");
     free(entry);
-    pthread_mutex_unlock(&cache.global_lock);
-    return -1;
+    return NULL;
   }
 
-  pstring_init(&entry->data);
   entry->url = strdup(url);
   if (entry->url == NULL) {
     perror("Cannot duplicate URL string for cache entry");
     pthread_rwlock_destroy(&entry->lock);
     free(entry);
-    pthread_mutex_unlock(&cache.global_lock);
+    return NULL;
+  }
+  entry->hash = hash;
+  entry->refs = 2;
+  entry->indexed = true;
+
+  return entry;
+}
+
+/**
+ * Links entry to stripe buckets.
+ * Must be called with stripe write lock held.
+ */
+static void link_entry(cache_stripe_t* stripe, cache_entry_t* entry) {
+  // New entries are linked first, so hot entries are found sooner
+  cache_entry_t** bucket = bucket_of(stripe, entry->hash);
+  entry->next = *bucket;
+  (*bucket) = entry;
+
+  if (++stripe->entries_count > stripe->buckets_count * CACHE_LOAD_FACTOR)
+    grow_buckets(stripe);
+}
+
+/**
+ * Checks, if entry can be used by new readers.
+ * Expired entry is used during stale-while-revalidate period,
+ * while single reader revalidates it.
+ *
+ * @param entry Target entry.
+ * @param now Current time.
+ * @param revalidate Set, if caller must revalidate entry.
+ *
+ * @return {@code true} if entry can be used.
+ */
+static bool entry_usable(cache_entry_t* entry, time_t now, bool* revalidate) {
+  cache_freshness_t* freshness = &entry->freshness;
+
+  // Responses in progress are shared with all their readers
+  (*revalidate) = false;
+  if (!entry->finished)
+    return true;
+
+  time_t expires = __atomic_load_n(&freshness->expires, __ATOMIC_RELAXED);
+  if (now < expires)
+    return true;
+  if (freshness->must_revalidate ||
+      now >= expires + freshness->stale_while_revalidate)
+    return false;
+
+  (*revalidate) =
+      !__atomic_exchange_n(&entry->revalidating, true, __ATOMIC_ACQ_REL);
+  return true;
+}
+
+int cache_find_or_create(char* url, cache_entry_t** result) {
+  cache_entry_t *entry, *stale;
+  time_t now = time(NULL);
+  bool revalidate;
+  int error;
+
+  if (url == NULL)
+    return -1;
+
+  uint64_t hash = fnv1a_hash(url);
+  cache_stripe_t* stripe = stripe_of(hash);
+
+  // Misses are counted too, so admission knows popularity of new entries
+  frequency_sketch_increment(&cache.sketch, hash);
+
+  // Most lookups are hits, so search under shared lock first
+  error = pthread_rwlock_rdlock(&stripe->lock);
+  if (error) {
+    proxy_error(error, "Cannot lock cache stripe");
     return -1;
   }
-  entry->next = cache.list;
-  cache.list = entry;
-  (*result) = entry;
+  entry = find_entry(stripe, url, hash);
+  pthread_rwlock_unlock(&stripe->lock);
+
+  if (entry != NULL) {
+    if (entry_usable(entry, now, &revalidate)) {
+      (*result) = entry;
+      return revalidate ? 2 : 0;
+    }
+    cache_entry_release(entry);
+  }
+
+  error = pthread_rwlock_wrlock(&stripe->lock);
+  if (error) {
+    proxy_error(error, "Cannot lock cache stripe");
+    return -1;
+  }
+
+  // Entry could be created while lock was released
+  entry = find_entry(stripe, url, hash);
+  if (entry != NULL && entry_usable(entry, now, &revalidate)) {
+    pthread_rwlock_unlock(&stripe->lock);
+    (*result) = entry;
+    return revalidate ? 2 : 0;
+  }
+
+  // Stale entry is replaced, its current readers keep it
+  stale = entry;
+  if (stale != NULL)
+    stale->invalid = true;
+
+  // Lookup reference of stale entry is passed to new one
+  entry = create_entry(url, hash);
+  if (entry != NULL) {
+    link_entry(stripe, entry);
+    entry->stale = stale;
+  }
+
+  pthread_rwlock_unlock(&stripe->lock);
+
+  if (stale != NULL) {
+    cache_entry_mark_invalid(stale);
+    if (entry == NULL)
+      cache_entry_release(stale);
+  }
+
+  if (entry == NULL)
+    return -1;
 
-  pthread_mutex_unlock(&cache.global_lock);
+  (*result) = entry;
   return 1;
 }
 
+void cache_entry_retain(cache_entry_t* entry) {
+  __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+}
+
+void cache_entry_release(cache_entry_t* entry) {
+  if (entry == NULL)
+    return;
+
+  if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    entry_free(entry);
+}
+
+/**
+ * Unlinks entry from stripe buckets.
+ * Must be called with stripe write lock held.
+ */
+static void unlink_entry(cache_stripe_t* stripe, cache_entry_t* entry) {
+  cache_entry_t** link = bucket_of(stripe, entry->hash);
+  while (*link != entry)
+    link = &(*link)->next;
+  (*link) = entry->next;
+  entry->indexed = false;
+  stripe->entries_count--;
+}
+
+/**
+ * Inserts entry to policy region ring just behind its hand,
+ * so entry is visited after all others.
+ * Must be called with policy lock held.
+ */
+static void region_link(cache_region_t* region, cache_entry_t* entry) {
+  if (region->hand == NULL) {
+    entry->region_prev = entry->region_next = entry;
+    region->hand = entry;
+  } else {
+    entry->region_next = region->hand;
+    entry->region_prev = region->hand->region_prev;
+    entry->region_prev->region_next = entry;
+    region->hand->region_prev = entry;
+  }
+
+  entry->region = region;
+  entry->region_size = entry->len;
+  region->count++;
+  region->size += entry->region_size;
+}
+
+/**
+ * Removes entry from its policy region.
+ * Must be called with policy lock held.
+ */
+static void region_unlink(cache_entry_t* entry) {
+  cache_region_t* region = entry->region;
+
+  if (region == NULL)
+    return;
+
+  if (entry->region_next == entry) {
+    region->hand = NULL;
+  } else {
+    entry->region_prev->region_next = entry->region_next;
+    entry->region_next->region_prev = entry->region_prev;
+    if (region->hand == entry)
+      region->hand = entry->region_next;
+  }
+
+  entry->region = NULL;
+  region->count--;
+  region->size -= entry->region_size;
+}
+
+/**
+ * Moves entry to the end of other policy region.
+ * Must be called with policy lock held.
+ */
+static void region_move(cache_entry_t* entry, cache_region_t* region) {
+  region_unlink(entry);
+  region_link(region, entry);
+}
+
+/**
+ * Unlinks entry from index and drops index reference.
+ * Entry is freed here if it is not used by anyone.
+ */
+static void remove_entry(cache_entry_t* entry) {
+  cache_stripe_t* stripe = stripe_of(entry->hash);
+  int error;
+
+  error = pthread_rwlock_wrlock(&stripe->lock);
+  if (error) {
+    proxy_error(error, "Cannot lock cache stripe to remove entry");
+    return;
+  }
+
+  if (!entry->indexed) {
+    pthread_rwlock_unlock(&stripe->lock);
+    return;
+  }
+  unlink_entry(stripe, entry);
+
+  pthread_rwlock_unlock(&stripe->lock);
+
+  // Entry stays alive while it is in region, so eviction can check it
+  pthread_mutex_lock(&cache.policy_lock);
+  region_unlink(entry);
+  pthread_mutex_unlock(&cache.policy_lock);
+
+  cache_entry_release(entry);
+}
+
+/**
+ * Removes entry from cache, if it is referenced only by index.
+ * Must be called with policy lock held.
+ *
+ * @return {@code true} if entry removed.
+ */
+static bool drop_entry(cache_entry_t* entry) {
+  cache_stripe_t* stripe = stripe_of(entry->hash);
+
+  if (pthread_rwlock_wrlock(&stripe->lock))
+    return false;
+
+  // Nobody can find entry while stripe is locked
+  if (!entry->indexed || __atomic_load_n(&entry->refs, __ATOMIC_ACQUIRE) != 1) {
+    pthread_rwlock_unlock(&stripe->lock);
+    return false;
+  }
+  unlink_entry(stripe, entry);
+
+  pthread_rwlock_unlock(&stripe->lock);
+
+  region_unlink(entry);
+  cache_entry_release(entry);
+
+  return true;
+}
+
+/**
+ * Writes all data to file descriptor.
+ *
+ * @return {@code true} if success.
+ */
+static bool write_all(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t result = write(fd, data, len);
+    if (result == -1) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += result;
+    len -= result;
+  }
+
+  return true;
+}
+
+/**
+ * Allocates cache file name.
+ * Several URLs can have the same hash, so files are also numbered.
+ *
+ * @return File name or {@code NULL}.
+ */
+static char* make_file_name(uint64_t hash, size_t number) {
+  size_t len = strlen(cache.directory) + CACHE_FILE_NAME_LEN;
+  char* name = (char*)malloc(len);
+
+  if (name != NULL)
+    snprintf(name, len, "%s/%016" PRIx64 "-%zu", cache.directory, hash,
+             number);
+
+  return name;
+}
+
+/**
+ * Writes finished entry data to new file in cache directory.
+ *
+ * @param entry Target entry.
+ * @param number Cache file number.
+ *
+ * @return Created file name or {@code NULL}.
+ */
+static char* write_entry_file(cache_entry_t* entry, size_t number) {
+  char* name = make_file_name(entry->hash, number);
+  if (name == NULL)
+    return NULL;
+
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    perror("Cannot create cache file");
+    free(name);
+    return NULL;
+  }
+
+  // Finished entry data is not changed, so it is read without locks
+  for (size_t i = 0; i < entry->segments_count; i++) {
+    size_t part = entry->len - i * CACHE_SEGMENT_SIZE;
+    if (part > CACHE_SEGMENT_SIZE)
+      part = CACHE_SEGMENT_SIZE;
+    if (!write_all(fd, entry->segments->items[i]->data, part)) {
+      perror("Cannot write cache file");
+      close(fd);
+      unlink(name);
+      free(name);
+      return NULL;
+    }
+  }
+
+  close(fd);
+  return name;
+}
+
+/**
+ * Maps cache file to memory.
+ *
+ * @param name Cache file name.
+ * @param len Cache file length.
+ *
+ * @return Mapped data segment or {@code NULL}.
+ */
+static cache_segment_t* map_file(const char* name, size_t len) {
+  int fd = open(name, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    perror("Cannot open cache file");
+    return NULL;
+  }
+
+  cache_segment_t* mapping = (cache_segment_t*)malloc(sizeof(cache_segment_t));
+  if (mapping == NULL) {
+    close(fd);
+    return NULL;
+  }
+
+  mapping->data = (char*)mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping->data == MAP_FAILED) {
+    perror("Cannot map cache file");
+    free(mapping);
+    return NULL;
+  }
+  mapping->refs = 1;
+  mapping->mapped = len;
+
+  return mapping;
+}
+
+/**
+ * Returns mapping of entry stored in cache file.
+ * Restored entries are mapped on first use.
+ *
+ * @return Mapped data segment or {@code NULL}.
+ */
+static cache_segment_t* entry_mapping(cache_entry_t* entry) {
+  cache_segment_t* mapping = __atomic_load_n(&entry->mapping, __ATOMIC_ACQUIRE);
+  if (mapping != NULL)
+    return mapping;
+
+  mapping = map_file(entry->file_name, entry->len);
+  if (mapping == NULL)
+    return NULL;
+
+  // Other reader can map file at the same time
+  cache_segment_t* expected = NULL;
+  if (!__atomic_compare_exchange_n(&entry->mapping, &expected, mapping, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    cache_segment_release(mapping);
+    return expected;
+  }
+
+  return mapping;
+}
+
+/**
+ * Appends record about entry file to cache files journal.
+ */
+static void journal_add(cache_entry_t* entry, size_t number) {
+  cache_journal_record_t record = {number,     entry->len,
+                                   entry->freshness, entry->url,
+                                   entry->etag, entry->last_modified};
+
+  cache_journal_add(&cache.journal, &record);
+}
+
+/**
+ * Moves entry data from memory to file in cache directory,
+ * if entry is referenced only by index and caller.
+ * Policy lock is released while file is written, so caller pins entry
+ * and other evictions skip it meanwhile.
+ * Must be called with policy lock held.
+ *
+ * @return {@code true} if entry moved.
+ */
+static bool spill_entry(cache_entry_t* entry) {
+  cache_stripe_t* stripe = stripe_of(entry->hash);
+  cache_segment_t* mapping = NULL;
+
+  cache.spilling += entry->len;
+  pthread_mutex_unlock(&cache.policy_lock);
+
+  size_t number = __atomic_fetch_add(&cache.files_count, 1, __ATOMIC_RELAXED);
+  char* file_name = write_entry_file(entry, number);
+  if (file_name != NULL)
+    mapping = map_file(file_name, entry->len);
+
+  pthread_mutex_lock(&cache.policy_lock);
+  cache.spilling -= entry->len;
+
+  if (mapping == NULL)
+    goto error_mapping;
+
+  if (pthread_rwlock_wrlock(&stripe->lock))
+    goto error;
+
+  // Segments are replaced only while nobody can read them
+  if (!entry->indexed || __atomic_load_n(&entry->refs, __ATOMIC_ACQUIRE) != 2) {
+    pthread_rwlock_unlock(&stripe->lock);
+    goto error;
+  }
+  segments_free(entry);
+  entry->mapping = mapping;
+  entry->file_name = file_name;
+  entry->file_number = number;
+
+  pthread_rwlock_unlock(&stripe->lock);
+
+  journal_add(entry, number);
+  __atomic_sub_fetch(&cache.size, entry->len, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&cache.spills, 1, __ATOMIC_RELAXED);
+  region_move(entry, &cache.disk);
+
+  return true;
+
+error:
+  cache_segment_release(mapping);
+error_mapping:
+  if (file_name != NULL) {
+    unlink(file_name);
+    free(file_name);
+  }
+  return false;
+}
+
+/**
+ * Evicts entry from memory, if it is referenced only by index.
+ * Entry is moved to cache directory if it is used, region hand passes
+ * entry, which is not evicted.
+ * Must be called with policy lock held, it is released meanwhile,
+ * while entry file is written.
+ *
+ * @return {@code true} if entry evicted.
+ */
+static bool evict_entry(cache_entry_t* entry) {
+  size_t len = entry->len;
+
+  // Do not write file, which cannot be used
+  if (cache.directory != NULL && len > 0 && !entry->invalid &&
+      __atomic_load_n(&entry->refs, __ATOMIC_RELAXED) == 1) {
+    cache_entry_retain(entry);
+    bool spilled = spill_entry(entry);
+
+    // Entry is alive while it is in region, even if pin is released
+    bool removed = entry->region == NULL;
+    cache_entry_release(entry);
+    if (removed)
+      return false;
+    if (spilled)
+      goto evicted;
+  }
+
+  if (!drop_entry(entry)) {
+    // Entry is in use, try next one
+    if (entry->region->hand == entry)
+      entry->region->hand = entry->region_next;
+    return false;
+  }
+
+evicted:
+  __atomic_add_fetch(&cache.evictions, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&cache.evicted_bytes, len, __ATOMIC_RELAXED);
+  return true;
+}
+
+/**
+ * Removes cache files not found since previous visit,
+ * until cache directory fits its capacity.
+ * Must be called with policy lock held.
+ */
+static void evict_files(void) {
+  // Two turns are enough to clear all reference marks
+  size_t steps = cache.disk.count * 2;
+
+  while (cache.disk.size > cache.disk.capacity && steps-- > 0) {
+    cache_entry_t* entry = cache.disk.hand;
+    if (__atomic_exchange_n(&entry->referenced, false, __ATOMIC_RELAXED) ||
+        !drop_entry(entry))
+      cache.disk.hand = entry->region_next;
+  }
+}
+
+/**
+ * Selects main region eviction victim.
+ * Probation entries found since previous visit are promoted to protected
+ * region, protected entries not found since previous visit are demoted
+ * back to probation when protected region overflows.
+ * Must be called with policy lock held.
+ *
+ * @return Victim entry or {@code NULL} if main region is empty.
+ */
+static cache_entry_t* select_victim(void) {
+  cache_entry_t* entry;
+  // Two turns are enough to clear all reference marks
+  size_t steps = (cache.probation.count + cache.protected.count) * 2;
+
+  while ((entry = cache.probation.hand) != NULL && steps-- > 0) {
+    if (!__atomic_exchange_n(&entry->referenced, false, __ATOMIC_RELAXED))
+      return entry;
+
+    region_move(entry, &cache.protected);
+
+    while (cache.protected.size > cache.protected.capacity && steps-- > 0) {
+      entry = cache.protected.hand;
+      if (__atomic_exchange_n(&entry->referenced, false, __ATOMIC_RELAXED))
+        cache.protected.hand = entry->region_next;
+      else
+        region_move(entry, &cache.probation);
+    }
+  }
+
+  return cache.probation.hand;
+}
+
+/**
+ * Evicts finished entries without readers until cache fits its capacity.
+ * Entries overflowing window region compete with main region victim
+ * by estimated requests frequency, loser is evicted.
+ * Skipped if other thread already evicts entries.
+ */
+static void evict_entries(void) {
+  cache_entry_t* candidate;
+  cache_entry_t* victim;
+
+  if (__atomic_load_n(&cache.size, __ATOMIC_RELAXED) <= cache.capacity)
+    return;
+
+  if (pthread_mutex_trylock(&cache.policy_lock))
+    return;
+
+  size_t steps =
+      (cache.window.count + cache.probation.count + cache.protected.count) * 2;
+
+  // Entries being spilled already leave memory
+  while (steps-- > 0 && __atomic_load_n(&cache.size, __ATOMIC_RELAXED) >
+                            cache.capacity + cache.spilling) {
+    victim = select_victim();
+
+    candidate = NULL;
+    if (cache.window.size > cache.window.capacity || victim == NULL)
+      candidate = cache.window.hand;
+
+    if (candidate == NULL) {
+      if (victim == NULL)
+        break;
+      evict_entry(victim);
+      continue;
+    }
+
+    if (victim == NULL) {
+      region_move(candidate, &cache.probation);
+      continue;
+    }
+
+    if (frequency_sketch_estimate(&cache.sketch, candidate->hash) >
+        frequency_sketch_estimate(&cache.sketch, victim->hash)) {
+      // Candidate is admitted before policy lock can be released
+      region_move(candidate, &cache.probation);
+      evict_entry(victim);
+    } else if (evict_entry(candidate)) {
+      __atomic_add_fetch(&cache.rejections, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  evict_files();
+
+  pthread_mutex_unlock(&cache.policy_lock);
+}
+
+/**
+ * Moves entries overflowing window region to main region,
+ * while cache has free space.
+ * Must be called with policy lock held.
+ */
+static void balance_window(void) {
+  while (cache.window.size > cache.window.capacity &&
+         __atomic_load_n(&cache.size, __ATOMIC_RELAXED) <= cache.capacity)
+    region_move(cache.window.hand, &cache.probation);
+}
+
 cache_entry_reader_t* cache_entry_subscribe(cache_entry_t* entry,
                                             void (*callback)(cache_entry_t*,
                                                              void*),
@@ -110,6 +947,8 @@ cache_entry_reader_t* cache_entry_subscribe(cache_entry_t* entry,
   }
   reader->callback = callback;
   reader->arg = arg;
+  reader->refs = 0;
+  reader->pending = false;
 
   error = pthread_rwlock_wrlock(&entry->lock);
   if (error) {
@@ -128,7 +967,7 @@ cache_entry_reader_t* cache_entry_subscribe(cache_entry_t* entry,
 
 bool cache_entry_unsubscribe(cache_entry_t* entry,
                              cache_entry_reader_t* reader) {
-  cache_entry_reader_t* curr;
+  cache_entry_reader_t** link;
   int error;
 
   if (entry == NULL || reader == NULL)
@@ -140,159 +979,571 @@ bool cache_entry_unsubscribe(cache_entry_t* entry,
     return false;
   }
 
-  curr = entry->readers;
-  if (entry->readers == reader) {
-    entry->readers = entry->readers->next;
-    free(curr);
+  link = &entry->readers;
+  while (*link != NULL && *link != reader)
+    link = &(*link)->next;
+
+  if (*link == NULL) {
     pthread_rwlock_unlock(&entry->lock);
-    return true;
+    return false;
   }
+  (*link) = reader->next;
 
-  while (curr) {
-    if (curr->next == reader) {
-      curr->next = reader->next;
-      free(reader);
-      pthread_rwlock_unlock(&entry->lock);
-      return true;
-    }
+  pthread_rwlock_unlock(&entry->lock);
 
-    curr = curr->next;
-  }
+  // Reader can be still notified by batch collected before unlinking
+  while (__atomic_load_n(&reader->refs, __ATOMIC_ACQUIRE) != 0)
+    sched_yield();
 
-  pthread_rwlock_unlock(&entry->lock);
-  return false;
+  free(reader);
+  return true;
 }
 
-ssize_t cache_entry_extract(cache_entry_t* entry,
-                            size_t offset,
-                            char* buffer,
-                            size_t len) {
-  int error;
+int cache_entry_acquire(cache_entry_t* entry,
+                        size_t offset,
+                        cache_slice_t* slices,
+                        int max) {
+  int count = 0;
 
-  if (entry == NULL || buffer == NULL)
+  if (entry == NULL || slices == NULL)
     return -1;
 
-  error = pthread_rwlock_rdlock(&entry->lock);
-  if (error) {
-    proxy_error(error, "Cannot use read lock for cache entry");
+  // Writer publishes segments before length
+  size_t len = __atomic_load_n(&entry->len, __ATOMIC_ACQUIRE);
+  cache_segments_t* segments =
+      __atomic_load_n(&entry->segments, __ATOMIC_ACQUIRE);
+
+  if (len < offset)
     return -1;
+
+  // Data of entry moved to file is sent from single mapping
+  if (entry->file_name != NULL) {
+    if (offset == len || max == 0)
+      return 0;
+
+    cache_segment_t* mapping = entry_mapping(entry);
+    if (mapping == NULL)
+      return -1;
+
+    __atomic_add_fetch(&mapping->refs, 1, __ATOMIC_RELAXED);
+    slices[0].segment = mapping;
+    slices[0].data = mapping->data + offset;
+    slices[0].len = len - offset;
+    return 1;
   }
 
-  if (entry->data.len < offset) {
-    pthread_rwlock_unlock(&entry->lock);
-    return -1;
+  // Committed bytes are never changed, so they are safe to send
+  while (count < max && offset < len) {
+    size_t pos = offset / CACHE_SEGMENT_SIZE;
+    cache_segment_t* segment = segments->items[pos];
+    size_t end = (pos + 1) * CACHE_SEGMENT_SIZE;
+    if (end > len)
+      end = len;
+
+    __atomic_add_fetch(&segment->refs, 1, __ATOMIC_RELAXED);
+    slices[count].segment = segment;
+    slices[count].data = segment->data + offset % CACHE_SEGMENT_SIZE;
+    slices[count].len = end - offset;
+    offset = end;
+    count++;
   }
 
-  size_t result_len = entry->data.len - offset;
-  if (result_len > len)
-    result_len = len;
+  return count;
+}
+
+void cache_segment_release(cache_segment_t* segment) {
+  if (__atomic_sub_fetch(&segment->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+
+  if (segment->mapped)
+    munmap(segment->data, segment->mapped);
+  free(segment);
+}
+
+/**
+ * Notifies entry readers about updates.
+ * Readers are collected under entry lock and notified after its release.
+ * Reader already collected by other notification is skipped, since
+ * it will see this update too.
+ */
+static void notify_readers(cache_entry_t* entry) {
+  cache_entry_reader_t* batch = NULL;
+  cache_entry_reader_t* reader;
+  int error;
 
-  memcpy(buffer, entry->data.str + offset, result_len);
+  error = pthread_rwlock_rdlock(&entry->lock);
+  if (error) {
+    proxy_error(error, "Cannot lock cache entry to notify readers");
+    return;
+  }
+
+  for (reader = entry->readers; reader != NULL; reader = reader->next) {
+    if (__atomic_exchange_n(&reader->pending, true, __ATOMIC_ACQ_REL))
+      continue;
+    __atomic_add_fetch(&reader->refs, 1, __ATOMIC_RELAXED);
+    reader->batch_next = batch;
+    batch = reader;
+  }
 
   pthread_rwlock_unlock(&entry->lock);
-  return result_len;
+
+  while (batch != NULL) {
+    reader = batch;
+    batch = reader->batch_next;
+
+    // Updates after this point are reported by next notification
+    __atomic_store_n(&reader->pending, false, __ATOMIC_SEQ_CST);
+    reader->callback(entry, reader->arg);
+    __atomic_sub_fetch(&reader->refs, 1, __ATOMIC_RELEASE);
+  }
 }
 
-static void readers_foreach(cache_entry_t* entry, size_t len) {
-  cache_entry_reader_t* reader = entry->readers;
-  cache_entry_reader_t* curr;
-  while (reader) {
-    // This order is because that in
-    // the callback you can delete the reader
-    curr = reader;
-    reader = reader->next;
-    curr->callback(entry, curr->arg);
+/**
+ * Adds empty segment to the end of entry data.
+ * Segments array is replaced with bigger copy when full, old array
+ * can be used by readers, so it is retired until entry is freed.
+ * Must be called by entry writer.
+ *
+ * @return Added segment or {@code NULL}.
+ */
+static cache_segment_t* add_segment(cache_entry_t* entry) {
+  cache_segments_t* segments = entry->segments;
+
+  if (segments == NULL || entry->segments_count >= segments->size) {
+    size_t size = segments ? segments->size * CACHE_SEGMENTS_GROW_SPEED
+                           : CACHE_PRE_SEGMENTS;
+    cache_segments_t* temp = (cache_segments_t*)malloc(
+        sizeof(cache_segments_t) + size * sizeof(cache_segment_t*));
+    if (temp == NULL)
+      return NULL;
+
+    temp->retired = segments;
+    temp->size = size;
+    if (segments != NULL)
+      memcpy(temp->items, segments->items,
+             entry->segments_count * sizeof(cache_segment_t*));
+    segments = temp;
+    __atomic_store_n(&entry->segments, segments, __ATOMIC_RELEASE);
   }
+
+  // Data is allocated together with segment header
+  cache_segment_t* segment =
+      (cache_segment_t*)malloc(sizeof(cache_segment_t) + CACHE_SEGMENT_SIZE);
+  if (segment == NULL)
+    return NULL;
+  // Referenced by entry
+  segment->refs = 1;
+  segment->mapped = 0;
+  segment->data = (char*)(segment + 1);
+
+  segments->items[entry->segments_count++] = segment;
+  return segment;
 }
 
-bool cache_entry_append(cache_entry_t* entry, const char* data, size_t len) {
-  int error;
+/**
+ * Makes appended entry data visible for readers.
+ * Must be called by entry writer.
+ */
+static void commit_data(cache_entry_t* entry, size_t len) {
+  __atomic_store_n(&entry->len, entry->len + len, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&cache.size, len, __ATOMIC_RELAXED);
+}
 
+bool cache_entry_append(cache_entry_t* entry, const char* data, size_t len) {
   if (entry == NULL || data == NULL)
     return false;
 
-  error = pthread_rwlock_wrlock(&entry->lock);
-  if (error) {
-    proxy_error(error, "Cannot lock cache entry in entry append");
+  // Stored bytes are never moved, new data fills last segment first
+  size_t appended = 0;
+  while (appended < len) {
+    size_t pos = entry->len + appended;
+    size_t segment_offset = pos % CACHE_SEGMENT_SIZE;
+
+    if (pos / CACHE_SEGMENT_SIZE >= entry->segments_count &&
+        add_segment(entry) == NULL) {
+      perror("Cannot cache entry data");
+      // Keep already copied data consistent with segments
+      commit_data(entry, appended);
+      return false;
+    }
+
+    size_t part = CACHE_SEGMENT_SIZE - segment_offset;
+    if (part > len - appended)
+      part = len - appended;
+
+    cache_segment_t* segment = entry->segments->items[pos / CACHE_SEGMENT_SIZE];
+    memcpy(segment->data + segment_offset, data + appended, part);
+    appended += part;
+  }
+
+  commit_data(entry, len);
+  notify_readers(entry);
+
+  evict_entries();
+  return true;
+}
+
+cache_entry_t* cache_entry_create_revalidation(cache_entry_t* stale) {
+  cache_entry_t* entry = create_entry(stale->url, stale->hash);
+
+  if (entry == NULL) {
+    __atomic_store_n(&stale->revalidating, false, __ATOMIC_RELEASE);
+    return NULL;
+  }
+
+  // Entry is not indexed, until it replaces stale one
+  entry->refs = 1;
+  entry->indexed = false;
+  cache_entry_retain(stale);
+  entry->stale = stale;
+
+  return entry;
+}
+
+/**
+ * Copies freshness, expiration time is stored last.
+ */
+static void copy_freshness(cache_freshness_t* target,
+                           const cache_freshness_t* source) {
+  target->lifetime = source->lifetime;
+  target->stale_while_revalidate = source->stale_while_revalidate;
+  target->stale_if_error = source->stale_if_error;
+  target->must_revalidate = source->must_revalidate;
+  __atomic_store_n(&target->expires, source->expires, __ATOMIC_RELEASE);
+}
+
+void cache_entry_set_freshness(cache_entry_t* entry,
+                               const cache_freshness_t* freshness) {
+  if (entry != NULL)
+    copy_freshness(&entry->freshness, freshness);
+}
+
+/**
+ * Replaces stored string by copy of other one.
+ * Missing validator only disables revalidation, so copy can fail.
+ */
+static void replace_string(char** target, const char* value) {
+  free(*target);
+  (*target) = value != NULL ? strdup(value) : NULL;
+}
+
+void cache_entry_set_validators(cache_entry_t* entry,
+                                const char* etag,
+                                const char* last_modified) {
+  if (entry != NULL) {
+    replace_string(&entry->etag, etag);
+    replace_string(&entry->last_modified, last_modified);
+  }
+}
+
+/**
+ * Releases stale entry, which is not revalidated.
+ * Stale entry can be revalidated again.
+ */
+static void release_stale(cache_entry_t* entry) {
+  cache_entry_t* stale = entry->stale;
+
+  if (stale == NULL)
+    return;
+
+  entry->stale = NULL;
+  __atomic_store_n(&stale->revalidating, false, __ATOMIC_RELEASE);
+  cache_entry_release(stale);
+}
+
+/**
+ * Replaces stale entry in index by finished entry,
+ * which was revalidating it in background.
+ *
+ * @return {@code true} if entry is indexed.
+ */
+static bool publish_entry(cache_entry_t* entry) {
+  cache_entry_t* stale = entry->stale;
+  cache_stripe_t* stripe = stripe_of(entry->hash);
+
+  if (pthread_rwlock_wrlock(&stripe->lock))
+    return false;
+
+  // Stale entry could be replaced by other reader
+  if (!stale->indexed) {
+    pthread_rwlock_unlock(&stripe->lock);
     return false;
   }
+  unlink_entry(stripe, stale);
+  stale->invalid = true;
+  entry->indexed = true;
+  cache_entry_retain(entry);
+  link_entry(stripe, entry);
 
-  if (!pstring_append(&entry->data, data, len)) {
-    perror("Cannot cache entry data");
-    pthread_rwlock_unlock(&entry->lock);
+  pthread_rwlock_unlock(&stripe->lock);
+
+  pthread_mutex_lock(&cache.policy_lock);
+  region_unlink(stale);
+  pthread_mutex_unlock(&cache.policy_lock);
+
+  cache_entry_release(stale);
+  return true;
+}
+
+/**
+ * Returns stale entry to index instead of entry.
+ * Fails, if entry is already removed from index, since other entry
+ * could be created for the same URL.
+ *
+ * @return {@code true} if stale entry is returned.
+ */
+static bool restore_stale(cache_entry_t* entry) {
+  cache_entry_t* stale = entry->stale;
+  cache_stripe_t* stripe = stripe_of(entry->hash);
+
+  if (pthread_rwlock_wrlock(&stripe->lock))
+    return false;
+
+  if (!entry->indexed) {
+    pthread_rwlock_unlock(&stripe->lock);
     return false;
   }
+  unlink_entry(stripe, entry);
+  stale->invalid = false;
+  stale->indexed = true;
+  cache_entry_retain(stale);
+  link_entry(stripe, stale);
 
-  readers_foreach(entry, len);
+  pthread_rwlock_unlock(&stripe->lock);
 
-  pthread_rwlock_unlock(&entry->lock);
+  // Stale entry was removed from its region, when it was replaced
+  pthread_mutex_lock(&cache.policy_lock);
+  if (stale->file_name != NULL) {
+    region_link(&cache.disk, stale);
+  } else {
+    region_link(&cache.window, stale);
+    balance_window();
+  }
+  pthread_mutex_unlock(&cache.policy_lock);
 
+  cache_entry_release(entry);
   return true;
 }
 
-void cache_entry_mark_finished(cache_entry_t* entry) {
-  int error;
+void cache_entry_mark_stale_used(cache_entry_t* entry) {
+  cache_entry_t* stale = entry->stale;
+
+  // Background revalidation entry is not indexed, stale entry stays
+  bool restored = restore_stale(entry);
+  __atomic_store_n(&stale->revalidating, false, __ATOMIC_RELEASE);
+
+  // Readers switch to stale entry, when they see finish
+  entry->invalid = true;
+  entry->revalidated = true;
+  entry->finished = true;
+
+  notify_readers(entry);
+
+  if (restored)
+    evict_entries();
+}
+
+void cache_entry_mark_revalidated(cache_entry_t* entry) {
+  // Validators are not changed, since response is not modified
+  copy_freshness(&entry->stale->freshness, &entry->freshness);
+  cache_entry_mark_stale_used(entry);
+}
+
+bool cache_entry_stale_usable(cache_entry_t* entry, bool disconnected) {
+  cache_entry_t* stale = entry->stale;
 
+  if (stale == NULL || stale->freshness.must_revalidate)
+    return false;
+
+  // Disconnected cache can use stale responses (RFC 9111 4.2.4)
+  return disconnected || time(NULL) < stale->freshness.expires +
+                                          stale->freshness.stale_if_error;
+}
+
+void cache_entry_mark_finished(cache_entry_t* entry) {
   if (entry != NULL) {
+    if (!entry->indexed && entry->stale != NULL && !publish_entry(entry))
+      entry->invalid = true;
+
     entry->finished = true;
+    release_stale(entry);
 
-    error = pthread_rwlock_rdlock(&entry->lock);
-    if (error) {
-      proxy_error(error, "Cannot lock cache entry in entry mark finished");
-      return;
-    }
+    notify_readers(entry);
 
-    readers_foreach(entry, 0);
+    // Only finished entries can be evicted
+    pthread_mutex_lock(&cache.policy_lock);
+    if (!entry->invalid && entry->region == NULL) {
+      region_link(&cache.window, entry);
+      balance_window();
+    }
+    pthread_mutex_unlock(&cache.policy_lock);
 
-    pthread_rwlock_unlock(&entry->lock);
+    evict_entries();
   }
 }
 
 void cache_entry_mark_invalid(cache_entry_t* entry) {
-  if (entry != NULL)
+  if (entry != NULL) {
     entry->invalid = true;
+    remove_entry(entry);
+  }
 }
 
 void cache_entry_mark_invalid_and_finished(cache_entry_t* entry) {
-  int error;
-
   if (entry != NULL) {
     entry->invalid = true;
     entry->finished = true;
+    release_stale(entry);
+    remove_entry(entry);
 
-    error = pthread_rwlock_rdlock(&entry->lock);
-    if (error) {
-      proxy_error(error, "Cannot lock cache entry in entry mark finished");
-      return;
-    }
+    notify_readers(entry);
+  }
+}
 
-    readers_foreach(entry, 0);
+/**
+ * Inserts entry stored in cache file before restart to index.
+ * Entry with missing or damaged file is forgotten.
+ */
+static void restore_entry(cache_journal_record_t* record) {
+  struct stat info;
+  uint64_t hash = fnv1a_hash(record->url);
+  cache_stripe_t* stripe = stripe_of(hash);
 
-    pthread_rwlock_unlock(&entry->lock);
+  char* file_name = make_file_name(hash, record->number);
+  if (file_name == NULL)
+    return;
+
+  if (record->len == 0 || stat(file_name, &info) ||
+      (size_t)info.st_size != record->len)
+    goto forget;
+
+  // Files of the same URL left by crash are duplicates, the newest is kept
+  cache_entry_t* entry = find_entry(stripe, record->url, hash);
+  if (entry != NULL) {
+    bool newer = entry->file_number > record->number;
+    cache_entry_release(entry);
+    if (newer)
+      goto forget;
+
+    // Index reference is the last one, so older file is removed too
+    unlink_entry(stripe, entry);
+    region_unlink(entry);
+    cache_entry_release(entry);
+  }
+
+  entry = create_entry(record->url, hash);
+  if (entry == NULL) {
+    free(file_name);
+    return;
   }
+
+  // Restored entry is referenced only by index
+  entry->refs = 1;
+  entry->finished = true;
+  entry->len = record->len;
+  entry->freshness = record->freshness;
+  entry->etag = record->etag;
+  entry->last_modified = record->last_modified;
+  record->etag = record->last_modified = NULL;
+  entry->file_name = file_name;
+  entry->file_number = record->number;
+  link_entry(stripe, entry);
+  region_link(&cache.disk, entry);
+  return;
+
+forget:
+  unlink(file_name);
+  cache_journal_remove(&cache.journal, record->number);
+  free(file_name);
 }
 
-static void readers_free(cache_entry_reader_t* readers) {
-  cache_entry_reader_t* curr = readers;
-  while (curr) {
-    readers = curr->next;
-    free(curr);
-    curr = readers;
+/**
+ * Restores entries stored in cache files before restart.
+ * Files data is mapped on first use, so startup does not read it.
+ *
+ * @return {@code 0} if success or error code.
+ */
+static int load_files(void) {
+  cache_journal_record_t* records;
+  size_t count;
+
+  int error =
+      cache_journal_open(&cache.journal, cache.directory, &records, &count);
+  if (error)
+    return error;
+
+  for (size_t i = 0; i < count; i++) {
+    if (records[i].number >= cache.files_count)
+      cache.files_count = records[i].number + 1;
+    restore_entry(&records[i]);
+  }
+  cache_journal_records_free(records, count);
+
+  // Disk capacity can be reduced since restart
+  pthread_mutex_lock(&cache.policy_lock);
+  evict_files();
+  pthread_mutex_unlock(&cache.policy_lock);
+
+  return 0;
+}
+
+/**
+ * Stores finished entry kept in memory to cache file, while disk capacity
+ * allows, and detaches entry from its file, so file is kept after exit.
+ *
+ * @param entry Target entry.
+ * @param disk_size Used disk size.
+ */
+static void persist_entry(cache_entry_t* entry, size_t* disk_size) {
+  if (entry->file_name == NULL && entry->finished && !entry->invalid &&
+      entry->len > 0 && *disk_size + entry->len <= cache.disk.capacity) {
+    size_t number = cache.files_count++;
+    char* file_name = write_entry_file(entry, number);
+    if (file_name != NULL) {
+      journal_add(entry, number);
+      (*disk_size) += entry->len;
+      free(file_name);
+    }
+    return;
   }
+
+  free(entry->file_name);
+  entry->file_name = NULL;
 }
 
 void cache_free(void) {
-  cache_entry_t* curr = cache.list;
-  while (curr) {
-    pthread_rwlock_destroy(&curr->lock);
-    readers_free(curr->readers);
-    free(curr->url);
-    pstring_free(&curr->data);
+  size_t disk_size = cache.disk.size;
 
-    cache.list = curr->next;
-    free(curr);
-    curr = cache.list;
+  if (cache.stripes == NULL)
+    return;
+
+  for (size_t i = 0; i < CACHE_STRIPES; i++) {
+    cache_stripe_t* stripe = &cache.stripes[i];
+
+    // Entries still referenced by connections are freed with index
+    for (size_t j = 0; j < stripe->buckets_count; j++) {
+      cache_entry_t* curr = stripe->buckets[j];
+      while (curr) {
+        stripe->buckets[j] = curr->next;
+        if (cache.directory != NULL)
+          persist_entry(curr, &disk_size);
+        entry_free(curr);
+        curr = stripe->buckets[j];
+      }
+    }
+
+    stripe_destroy(stripe);
   }
 
-  pthread_mutex_destroy(&cache.global_lock);
+  free(cache.stripes);
+  cache.stripes = NULL;
+  region_init(&cache.window, 0);
+  region_init(&cache.probation, 0);
+  region_init(&cache.protected, 0);
+  region_init(&cache.disk, 0);
+  frequency_sketch_free(&cache.sketch);
+  pthread_mutex_destroy(&cache.policy_lock);
+  cache_journal_close(&cache.journal);
+  free(cache.directory);
+  cache.directory = NULL;
 }
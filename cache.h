@@ -2,55 +2,187 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 
-#include "pstring.h"
+#include "cache-control.h"
+#include "cache-journal.h"
+#include "frequency-sketch.h"
 
 #ifndef _CACHE_H
 #define _CACHE_H
 
+#define CACHE_SEGMENT_SIZE (64 * 1024)
+
 struct cache_entry;
+struct cache_region;
 
 typedef struct cache_entry_reader {
   void (*callback)(struct cache_entry*, void*);
   void* arg;
+  size_t refs;
+  bool pending;
+  struct cache_entry_reader* batch_next;
   struct cache_entry_reader* next;
 } cache_entry_reader_t;
 
+typedef struct cache_segment {
+  size_t refs;
+  size_t mapped;
+  char* data;
+} cache_segment_t;
+
+typedef struct cache_segments {
+  struct cache_segments* retired;
+  size_t size;
+  cache_segment_t* items[];
+} cache_segments_t;
+
+typedef struct cache_slice {
+  cache_segment_t* segment;
+  const char* data;
+  size_t len;
+} cache_slice_t;
+
 typedef struct cache_entry {
   char* url;
+  uint64_t hash;
+  size_t refs;
+  bool indexed;
+  bool referenced;
+  struct cache_region* region;
+  size_t region_size;
+  struct cache_entry* region_prev;
+  struct cache_entry* region_next;
   volatile bool finished;
   volatile bool invalid;
-  pstring_t data;
+  volatile bool revalidated;
+  bool revalidating;
+  cache_freshness_t freshness;
+  char* etag;
+  char* last_modified;
+  struct cache_entry* stale;
+  size_t len;
+  size_t segments_count;
+  cache_segments_t* segments;
+  cache_segment_t* mapping;
+  char* file_name;
+  size_t file_number;
   cache_entry_reader_t* readers;
   pthread_rwlock_t lock;
   struct cache_entry* next;
 } cache_entry_t;
 
+typedef struct cache_stripe {
+  pthread_rwlock_t lock;
+  size_t entries_count;
+  size_t buckets_count;
+  cache_entry_t** buckets;
+} cache_stripe_t;
+
+typedef struct cache_region {
+  cache_entry_t* hand;
+  size_t count;
+  size_t size;
+  size_t capacity;
+} cache_region_t;
+
 typedef struct cache {
-  pthread_mutex_t global_lock;
-  cache_entry_t* list;
+  cache_stripe_t* stripes;
+  size_t capacity;
+  size_t size;
+  char* directory;
+  size_t files_count;
+  // Size of entries written to files without policy lock
+  size_t spilling;
+  cache_journal_t journal;
+  pthread_mutex_t policy_lock;
+  frequency_sketch_t sketch;
+  cache_region_t window;
+  cache_region_t probation;
+  cache_region_t protected;
+  cache_region_t disk;
+  size_t evictions;
+  size_t evicted_bytes;
+  size_t rejections;
+  size_t spills;
 } cache_t;
 
+typedef struct cache_stats {
+  size_t capacity;
+  size_t size;
+  size_t disk_capacity;
+  size_t disk_size;
+  size_t evictions;
+  size_t evicted_bytes;
+  size_t rejections;
+  size_t spills;
+} cache_stats_t;
+
 /**
  * Init cache.
+ * Finished entries without readers are evicted, when cached data size
+ * exceeds capacity. Finished entries enter small window region first,
+ * entries leaving window are admitted to main region only if they are
+ * requested more often than main region victims (W-TinyLFU).
+ * If cache directory is set, evicted entries are moved to files in it
+ * and served from memory mappings, until disk capacity is exceeded.
+ * Cache files are kept on exit and restored from cache directory journal,
+ * their data is mapped on first use.
+ *
+ * @param capacity Cached data size limit in bytes.
+ * @param directory Cache files directory or {@code NULL}.
+ * @param disk_capacity Cache files size limit in bytes.
  *
  * @return {@code 0} if success.
  */
-int cache_init(void);
+int cache_init(size_t capacity, const char* directory, size_t disk_capacity);
+
+/**
+ * Reads cache usage and eviction counters.
+ *
+ * @param stats Counters storage.
+ */
+void cache_get_stats(cache_stats_t* stats);
 
 /**
  * Finds stored cache entry or creates new, if not exists.
+ * Finished entry is used only until it expires, then it is replaced
+ * by new one. Entries in progress are shared with all readers.
+ * Expired entry is still used during its stale-while-revalidate period,
+ * first caller must revalidate it in background.
+ * Replaced expired entry is kept by new entry as stale one, so it can be
+ * revalidated instead of receiving whole response again or used on error.
+ * Returned entry is referenced by caller and must be released.
  *
  * @param url Entry name.
  * @param entry Returning entry.
  *
  * @return {@code 0} if entry found, {@code 1} if not found and
- * created and {@code -1} if error occured.
+ * created, {@code 2} if expired entry found and must be revalidated
+ * and {@code -1} if error occured.
  */
 int cache_find_or_create(char* url, cache_entry_t** entry);
 
+/**
+ * Adds reference to cache entry.
+ *
+ * @param entry Target entry.
+ */
+void cache_entry_retain(cache_entry_t* entry);
+
+/**
+ * Drops reference to cache entry.
+ * Entry is freed when it is removed from cache and not referenced anymore.
+ *
+ * @param entry Target entry.
+ */
+void cache_entry_release(cache_entry_t* entry);
+
 /**
  * Create reader for entry.
+ * Callback is called without entry lock, several updates can be
+ * reported by one call.
  *
  * @param entry Target entry.
  * @param callback Callback for cache updates.
@@ -65,6 +197,8 @@ cache_entry_reader_t* cache_entry_subscribe(cache_entry_t* entry,
 
 /**
  * Unsubscribes reader associated with cache entry.
+ * Waits for running reader callback, so callback argument
+ * can be freed after return.
  *
  * @param entry Target entry.
  * @param reader Target reader.
@@ -75,22 +209,34 @@ bool cache_entry_unsubscribe(cache_entry_t* entry,
                              cache_entry_reader_t* reader);
 
 /**
- * Extracts data part from cache entry.
+ * References data of cache entry without copying.
+ * Each slice holds reference to its segment, so data stays valid
+ * even if entry is freed, until segment is released.
+ * Does not block appending, only data committed before call is returned.
  *
  * @param entry Target entry.
  * @param offset Offset from entry data beginning.
- * @param buffer Storage buffer.
- * @param len Storage buffer length.
+ * @param slices Storage for data slices.
+ * @param max Slices storage length.
  *
- * @return Amount of bytes stored to buffer or {@code -1} if error occured.
+ * @return Amount of stored slices or {@code -1} if error occured.
  */
-ssize_t cache_entry_extract(cache_entry_t* entry,
-                            size_t offset,
-                            char* buffer,
-                            size_t len);
+int cache_entry_acquire(cache_entry_t* entry,
+                        size_t offset,
+                        cache_slice_t* slices,
+                        int max);
+
+/**
+ * Drops reference to cache entry data segment.
+ *
+ * @param segment Target segment.
+ */
+void cache_segment_release(cache_segment_t* segment);
 
 /**
  * Appends new data to cache entry and notify all subscribers.
+ * Data is visible for readers after whole data appended.
+ * Each entry must have single writer.
  *
  * @param entry Target entry.
  * @param data Appending data.
@@ -100,6 +246,68 @@ ssize_t cache_entry_extract(cache_entry_t* entry,
  */
 bool cache_entry_append(cache_entry_t* entry, const char* data, size_t len);
 
+/**
+ * Creates entry for background revalidation of expired entry.
+ * Created entry is not found by readers, it replaces expired entry
+ * only when it is successfully finished.
+ *
+ * @param stale Expired entry, which is used during revalidation.
+ *
+ * @return Entry referenced by caller or {@code NULL}.
+ */
+cache_entry_t* cache_entry_create_revalidation(cache_entry_t* stale);
+
+/**
+ * Sets cache entry freshness.
+ * Entry expires immediately, if it is not set before finish.
+ *
+ * @param entry Target entry.
+ * @param freshness Response freshness.
+ */
+void cache_entry_set_freshness(cache_entry_t* entry,
+                               const cache_freshness_t* freshness);
+
+/**
+ * Stores validators of cached response, used for its revalidation.
+ * Must be called by entry writer before finish.
+ *
+ * @param entry Target entry.
+ * @param etag ETag value or {@code NULL}.
+ * @param last_modified Last-Modified value or {@code NULL}.
+ */
+void cache_entry_set_validators(cache_entry_t* entry,
+                                const char* etag,
+                                const char* last_modified);
+
+/**
+ * Checks, if stale entry of cache entry can be used, when response
+ * cannot be received.
+ *
+ * @param entry Target entry.
+ * @param disconnected Origin is not reachable.
+ *
+ * @return {@code true} if stale entry can be used.
+ */
+bool cache_entry_stale_usable(cache_entry_t* entry, bool disconnected);
+
+/**
+ * Marks stale entry of cache entry as valid again and returns it to cache
+ * instead of cache entry. Stale entry gets freshness of cache entry.
+ * Cache entry is marked as finished, invalid and revalidated
+ * and all its subscribers are notified, so they can use stale entry.
+ *
+ * @param entry Target entry, which must have stale entry.
+ */
+void cache_entry_mark_revalidated(cache_entry_t* entry);
+
+/**
+ * Returns stale entry of cache entry to cache without freshness update
+ * and makes subscribers use it, like after revalidation.
+ *
+ * @param entry Target entry, which must have stale entry.
+ */
+void cache_entry_mark_stale_used(cache_entry_t* entry);
+
 /**
  * Marks cache entry as successfully finished and notify all subscribers.
  *
@@ -108,7 +316,7 @@ bool cache_entry_append(cache_entry_t* entry, const char* data, size_t len);
 void cache_entry_mark_finished(cache_entry_t* entry);
 
 /**
- * Marks cache entry as invalid.
+ * Marks cache entry as invalid and removes it from cache.
  * If entry marked as invalid, new readers will not connect to this entry.
  *
  * @param entry Target entry.
@@ -118,6 +326,7 @@ void cache_entry_mark_invalid(cache_entry_t* entry);
 /**
  * Marks cache entry as finished and invalid and notify all subscibers.
  * If entry marked as invalid, new readers will not connect to this entry.
+ * Entry is removed from cache.
  *
  * @param entry Target entry.
  */
@@ -0,0 +1,87 @@
+#include <errno.h>
+#include <stdlib.h>
+
+#include "frequency-sketch.h"
+
+// Amount of counter rows, each uses own hash function
+#define SKETCH_DEPTH 4
+// Counters are saturated like 4-bit ones
+#define SKETCH_MAX_COUNT 15
+// Counters are halved after this amount of accesses per counter in row
+#define SKETCH_SAMPLE_FACTOR 10
+#define SKETCH_MIN_WIDTH 64
+
+int frequency_sketch_init(frequency_sketch_t* sketch, size_t items) {
+  size_t width = SKETCH_MIN_WIDTH;
+
+  while (width < items)
+    width <<= 1;
+
+  sketch->table = (uint8_t*)calloc(width * SKETCH_DEPTH, sizeof(uint8_t));
+  if (sketch->table == NULL)
+    return errno;
+
+  sketch->width = width;
+  sketch->additions = 0;
+  sketch->sample_size = width * SKETCH_SAMPLE_FACTOR;
+  return 0;
+}
+
+/**
+ * @return Counter of item in required row.
+ */
+static uint8_t* counter_at(frequency_sketch_t* sketch,
+                           uint64_t hash,
+                           size_t row) {
+  // Rows hashes are derived from two halves of item hash
+  uint32_t low = (uint32_t)hash;
+  uint32_t high = (uint32_t)(hash >> 32);
+  size_t pos = (size_t)(low + row * high) & (sketch->width - 1);
+
+  return &sketch->table[row * sketch->width + pos];
+}
+
+/**
+ * Halves all counters.
+ */
+static void sketch_reset(frequency_sketch_t* sketch) {
+  for (size_t i = 0; i < sketch->width * SKETCH_DEPTH; i++) {
+    uint8_t value = __atomic_load_n(&sketch->table[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&sketch->table[i], value >> 1, __ATOMIC_RELAXED);
+  }
+}
+
+void frequency_sketch_increment(frequency_sketch_t* sketch, uint64_t hash) {
+  for (size_t row = 0; row < SKETCH_DEPTH; row++) {
+    uint8_t* counter = counter_at(sketch, hash, row);
+    if (__atomic_load_n(counter, __ATOMIC_RELAXED) < SKETCH_MAX_COUNT)
+      __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+  }
+
+  // Only one thread reaches sample size until it is reduced
+  if (__atomic_add_fetch(&sketch->additions, 1, __ATOMIC_RELAXED) ==
+      sketch->sample_size) {
+    sketch_reset(sketch);
+    __atomic_sub_fetch(&sketch->additions, sketch->sample_size / 2,
+                       __ATOMIC_RELAXED);
+  }
+}
+
+unsigned int frequency_sketch_estimate(frequency_sketch_t* sketch,
+                                       uint64_t hash) {
+  unsigned int result = SKETCH_MAX_COUNT;
+
+  for (size_t row = 0; row < SKETCH_DEPTH; row++) {
+    unsigned int value =
+        __atomic_load_n(counter_at(sketch, hash, row), __ATOMIC_RELAXED);
+    if (value < result)
+      result = value;
+  }
+
+  return result;
+}
+
+void frequency_sketch_free(frequency_sketch_t* sketch) {
+  free(sketch->table);
+  sketch->table = NULL;
+}
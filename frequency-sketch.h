@@ -0,0 +1,53 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef _FREQUENCY_SKETCH_H
+#define _FREQUENCY_SKETCH_H
+
+typedef struct frequency_sketch {
+  size_t width;
+  uint8_t* table;
+  size_t additions;
+  size_t sample_size;
+} frequency_sketch_t;
+
+/**
+ * Initializes count-min sketch for access frequency estimation.
+ * All counters are halved after each sample of accesses,
+ * so old popularity fades out.
+ *
+ * @param sketch Target sketch.
+ * @param items Expected amount of tracked items.
+ *
+ * @return {@code 0} if success or error code.
+ */
+int frequency_sketch_init(frequency_sketch_t* sketch, size_t items);
+
+/**
+ * Records item access.
+ * Can be called concurrently, lost updates are tolerated.
+ *
+ * @param sketch Target sketch.
+ * @param hash Item hash.
+ */
+void frequency_sketch_increment(frequency_sketch_t* sketch, uint64_t hash);
+
+/**
+ * Estimates item access frequency.
+ *
+ * @param sketch Target sketch.
+ * @param hash Item hash.
+ *
+ * @return Estimated amount of recent accesses.
+ */
+unsigned int frequency_sketch_estimate(frequency_sketch_t* sketch,
+                                       uint64_t hash);
+
+/**
+ * Frees sketch counters.
+ *
+ * @param sketch Target sketch.
+ */
+void frequency_sketch_free(frequency_sketch_t* sketch);
+
+#endif
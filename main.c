@@ -4,16 +4,69 @@
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "cache.h"
+#include "proxy-handler.h"
 #include "proxy-utils.h"
+#include "resolver.h"
 #include "sockets-handler.h"
+#include "target-pool.h"
+#include "worker-pool.h"
+
+#define WORKERS_PER_CPU 4
+#define DEFAULT_CACHE_MEGABYTES 256
+#define DEFAULT_DISK_CACHE_MEGABYTES 1024
+#define MEGABYTE (1024 * 1024)
+#define DEFAULT_IDLE_CONNECTIONS 64
+#define DEFAULT_IDLE_CONNECTIONS_PER_HOST 8
+#define DEFAULT_IDLE_TIMEOUT_SECONDS 30
+#define DEFAULT_RESOLVER_THREADS 4
+#define DEFAULT_RESOLVER_TTL_SECONDS 60
+#define DEFAULT_CONNECT_TIMEOUT_SECONDS 10
+#define DEFAULT_KEEP_ALIVE_TIMEOUT_SECONDS 15
+#define MILLIS_PER_SECOND 1000
 
 static void interrupt_handler(int signal) {
+  sockets_stop();
+}
+
+/**
+ * Closes connections and frees proxy state after reactors are stopped.
+ * Cache entries kept in memory are stored to cache files.
+ */
+static void shutdown_proxy(void) {
+  cache_stats_t stats;
+
+  // Resolved names start connections, so resolver is stopped first
+  resolver_free();
+
+  // Connections are closed by tasks, which must finish before freeing
+  sockets_hangup();
+  worker_pool_shutdown();
+  target_pool_free();
   sockets_destroy();
+  cache_get_stats(&stats);
+  printf(
+      "Cache used %zu of %zu bytes, evicted %zu entries (%zu bytes), "
+      "rejected %zu entries.\n",
+      stats.size, stats.capacity, stats.evictions, stats.evicted_bytes,
+      stats.rejections);
+  printf("Cache files used %zu of %zu bytes, %zu entries moved to files.\n",
+         stats.disk_size, stats.disk_capacity, stats.spills);
   cache_free();
   printf("Server closed.\n");
-  exit(0);
+}
+
+static void print_usage(char* name) {
+  fprintf(stderr,
+          "Usage: %s [-r <reactors>] [-w <workers>] [-c <cache-megabytes>] "
+          "[-d <cache-directory>] [-D <disk-cache-megabytes>] "
+          "[-i <idle-connections>] [-I <idle-connections-per-host>] "
+          "[-t <idle-timeout-seconds>] [-n <resolver-threads>] "
+          "[-T <resolver-ttl-seconds>] [-C <connect-timeout-seconds>] "
+          "[-k <keep-alive-timeout-seconds>] <listen-port>\n",
+          name);
 }
 
 int main(int argc, char* argv[]) {
@@ -21,13 +74,75 @@ int main(int argc, char* argv[]) {
   int server_socket;
   int result;
   int port;
+  int option;
+  int value = 1;
+  long reactors = sysconf(_SC_NPROCESSORS_ONLN);
+  long workers = reactors * WORKERS_PER_CPU;
+  long cache_size = DEFAULT_CACHE_MEGABYTES;
+  long disk_cache_size = DEFAULT_DISK_CACHE_MEGABYTES;
+  char* cache_directory = NULL;
+  long idle_connections = DEFAULT_IDLE_CONNECTIONS;
+  long idle_connections_per_host = DEFAULT_IDLE_CONNECTIONS_PER_HOST;
+  long idle_timeout = DEFAULT_IDLE_TIMEOUT_SECONDS;
+  long resolver_threads = DEFAULT_RESOLVER_THREADS;
+  long resolver_ttl = DEFAULT_RESOLVER_TTL_SECONDS;
+  long connect_timeout = DEFAULT_CONNECT_TIMEOUT_SECONDS;
+  long keep_alive_timeout = DEFAULT_KEEP_ALIVE_TIMEOUT_SECONDS;
+
+  while ((option = getopt(argc, argv, "r:w:c:d:D:i:I:t:n:T:C:k:")) != -1) {
+    switch (option) {
+      case 'r':
+        reactors = atol(optarg);
+        break;
+      case 'w':
+        workers = atol(optarg);
+        break;
+      case 'c':
+        cache_size = atol(optarg);
+        break;
+      case 'd':
+        cache_directory = optarg;
+        break;
+      case 'D':
+        disk_cache_size = atol(optarg);
+        break;
+      case 'i':
+        idle_connections = atol(optarg);
+        break;
+      case 'I':
+        idle_connections_per_host = atol(optarg);
+        break;
+      case 't':
+        idle_timeout = atol(optarg);
+        break;
+      case 'n':
+        resolver_threads = atol(optarg);
+        break;
+      case 'T':
+        resolver_ttl = atol(optarg);
+        break;
+      case 'C':
+        connect_timeout = atol(optarg);
+        break;
+      case 'k':
+        keep_alive_timeout = atol(optarg);
+        break;
+      default:
+        print_usage(argv[0]);
+        return -1;
+    }
+  }
 
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s <listen-port>\n", argv[0]);
+  if (optind != argc - 1 || reactors < 1 || workers < 1 ||
+      cache_size < 0 || disk_cache_size < 0 || idle_connections < 0 ||
+      idle_connections_per_host < 0 || idle_timeout < 0 ||
+      resolver_threads < 1 || resolver_ttl < 0 || connect_timeout < 1 ||
+      keep_alive_timeout < 0) {
+    print_usage(argv[0]);
     return -1;
   }
 
-  port = atoi(argv[1]);
+  port = atoi(argv[optind]);
   fprintf(stderr, "Binding server socket listener to %d...\n", port);
 
   server_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -36,6 +151,11 @@ int main(int argc, char* argv[]) {
     return -1;
   }
 
+#ifdef SO_REUSEPORT
+  // Each reactor listens the same port
+  setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value));
+#endif
+
   addr.sin_family = AF_INET;
   addr.sin_port = htons(port);
   addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -46,14 +166,40 @@ int main(int argc, char* argv[]) {
 
   fprintf(stderr, "Server socket bound.\n");
 
-  result = cache_init();
+  result = cache_init((size_t)cache_size * MEGABYTE, cache_directory,
+                      (size_t)disk_cache_size * MEGABYTE);
   if (result) {
     proxy_error(result, "Cannot init cache");
     return -1;
   }
 
+  result = target_pool_init((size_t)idle_connections,
+                            (size_t)idle_connections_per_host, idle_timeout);
+  if (result) {
+    proxy_error(result, "Cannot init target connections pool");
+    return -1;
+  }
+
+  result = resolver_init((size_t)resolver_threads, resolver_ttl);
+  if (result) {
+    proxy_error(result, "Cannot start resolver");
+    return -1;
+  }
+
+  proxy_init(connect_timeout * MILLIS_PER_SECOND,
+             keep_alive_timeout * MILLIS_PER_SECOND);
+
+  result = worker_pool_init((size_t)workers);
+  if (result) {
+    proxy_error(result, "Cannot start workers");
+    return -1;
+  }
+
   signal(SIGPIPE, SIG_IGN);
   signal(SIGINT, &interrupt_handler);
 
-  return sockets_poll_loop(server_socket);
+  result = sockets_poll_loop(server_socket, (size_t)reactors);
+  shutdown_proxy();
+
+  return result;
 }
@@ -1,15 +1,19 @@
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "cache.h"
 #include "proxy-handler.h"
 #include "sockets-handler.h"
+#include "worker-pool.h"
 
 #include "proxy-client-handler.h"
 #include "proxy-utils.h"
@@ -17,15 +21,24 @@
 #define BUFFER_SIZE 4096
 
 // Strings for HTTP protocol
-#define HEADER_CONNECTION "Connection"
 #define HEADER_HOST "Host"
-#define HEADER_CONNECTION_CLOSE "close"
 #define PROTOCOL_VERSION_STR "HTTP/1.0"
 #define LINE_DELIM "\r\n"
 #define URL_PREFIX "http://"
 
 #define DEF_LEN(str) (sizeof(str) - 1)
 
+static long keep_alive_timeout;
+
+void client_handler_init(long timeout) {
+  keep_alive_timeout = timeout;
+}
+
+void client_wait_request(client_state_t* state) {
+  state->request_started = false;
+  sockets_set_timeout(state->socket, keep_alive_timeout);
+}
+
 /**
  * Saves the data that required to send to proxying target.
  *
@@ -53,13 +66,22 @@ static bool send_to_target(client_state_t* state,
     proxy_error(error, "Cannot lock client on target output buffer");
     return false;
   }
+
+  // Target is already finished, so rest of request is not required
+  if (state->target->closed) {
+    pthread_mutex_unlock(&state->target->lock);
+    return true;
+  }
+
   if (!pstring_append(&state->target->outbuff, buff, len)) {
     pthread_mutex_unlock(&state->target->lock);
     return false;
   }
-  pthread_mutex_unlock(&state->target->lock);
 
+  // Target socket is closed only after it is marked closed under lock
   sockets_enable_out_handle(state->target->socket);
+  pthread_mutex_unlock(&state->target->lock);
+
   sockets_cancel_in_handle(state->socket);
 
   return true;
@@ -154,12 +176,53 @@ static bool dump_initial_line(client_state_t* state) {
 static void accept_cache_updates(cache_entry_t* entry, void* arg) {
   client_state_t* state = (client_state_t*)arg;
 
-  if (entry->data.str != NULL) {
-    state->cache_updates = true;
-    sockets_enable_out_handle(state->socket);
+  if (__atomic_load_n(&entry->len, __ATOMIC_RELAXED) > 0 || entry->finished) {
+    // Output is already enabled by previous update, if it is not handled
+    if (!__atomic_exchange_n(&state->cache_updates, true, __ATOMIC_SEQ_CST))
+      sockets_enable_out_handle(state->socket);
   }
 }
 
+/**
+ * Dumps header line to proxying target.
+ *
+ * @return {@code true} if header line successfully sent.
+ */
+static bool dump_header(client_state_t* state,
+                        const char* key,
+                        const char* value) {
+  pstring_t key_str = {strlen(key), (char*)key};
+  pstring_t value_str = {strlen(value), (char*)value};
+  size_t len;
+
+  char* line = build_header_string(&key_str, &value_str, &len);
+  if (line == NULL) {
+    perror("Cannot allocate client output header line");
+    return false;
+  }
+
+  bool result = send_to_target(state, line, len);
+  free(line);
+
+  return result;
+}
+
+/**
+ * Dumps validators of stale cache entry to proxying target.
+ * Target is not connected yet, so request is buffered.
+ *
+ * @return {@code true} if validators successfully sent.
+ */
+static bool dump_validators(client_state_t* state) {
+  cache_entry_t* stale = state->cache->stale;
+
+  // Response to HEAD request cannot revalidate stale entry
+  if (stale == NULL || state->parser.method == HTTP_HEAD)
+    return true;
+
+  return proxy_append_validators(&state->target_outbuff, stale);
+}
+
 static char* form_entry_name(client_state_t* state, char* host) {
   if (state->url.str[0] == '/') {
     size_t host_len = strlen(host);
@@ -194,21 +257,52 @@ static bool establish_cached_connection(client_state_t* state, char* host) {
       cache_entry_subscribe(state->cache, &accept_cache_updates, state);
   state->use_cache = true;
 
+  // Already received data is not reported by subscription
+  sockets_enable_out_handle(state->socket);
+
   if (result == 1) {
     state->use_cache = false;
-    if (!proxy_establish_connection(state, host)) {
+    if (!dump_validators(state)) {
       cache_entry_mark_invalid_and_finished(state->cache);
       return false;
     }
 
+    if (!proxy_establish_connection(state, host)) {
+      // Disconnected cache serves stale response, if it is allowed
+      if (!cache_entry_stale_usable(state->cache, true)) {
+        cache_entry_mark_invalid_and_finished(state->cache);
+        return false;
+      }
+      cache_entry_mark_stale_used(state->cache);
+      state->use_cache = true;
+      proxy_log("Use stale cache to %s, URL: %s", host, state->url.str);
+      return true;
+    }
+
     proxy_log("Proxy data to %s, URL: %s", host, state->url.str);
     return true;
   }
 
+  // Expired entry is served, while it is revalidated in background
+  if (result == 2 && proxy_revalidate(state->cache, host))
+    proxy_log("Revalidate cache to %s, URL: %s", host, state->url.str);
+
   proxy_log("Use cache to %s, URL: %s", host, state->url.str);
   return true;
 }
 
+/**
+ * Handles request start, so connection is not idle anymore.
+ */
+static int handle_request_message_begin(http_parser* parser) {
+  client_state_t* state = (client_state_t*)parser->data;
+
+  state->request_started = true;
+  sockets_set_timeout(state->socket, -1);
+
+  return 0;
+}
+
 /**
  * Handles request URL input data.
  */
@@ -256,17 +350,18 @@ static bool handle_finished_header(client_state_t* state) {
   if (state->header_key.str == NULL)
     return true;
 
-  // Connection: close
-  if (!strncmp(state->header_key.str, HEADER_CONNECTION,
-               DEF_LEN(HEADER_CONNECTION))) {
-    pstring_replace(&state->header_value, HEADER_CONNECTION_CLOSE,
-                    DEF_LEN(HEADER_CONNECTION_CLOSE));
-    pstring_finalize(&state->header_value);
-    return dump_buffered_header(state);
-  }
-
   pstring_finalize(&state->header_value);
 
+  // Target connection is persistent, so client options are not forwarded.
+  // Response is shared, so it is not validated against client copy.
+  if (!strcasecmp(state->header_key.str, HEADER_CONNECTION) ||
+      !strcasecmp(state->header_key.str, HEADER_IF_NONE_MATCH) ||
+      !strcasecmp(state->header_key.str, HEADER_IF_MODIFIED_SINCE)) {
+    pstring_free(&state->header_key);
+    pstring_free(&state->header_value);
+    return true;
+  }
+
   // Host: <host>
   if (!strncmp(state->header_key.str, HEADER_HOST, DEF_LEN(HEADER_HOST))) {
     return establish_cached_connection(state, state->header_value.str) &&
@@ -332,7 +427,8 @@ static int handle_request_headers_complete(http_parser* parser) {
   client_state_t* state = (client_state_t*)parser->data;
 
   pstring_finalize(&state->url);
-  if (!handle_finished_header(state)) {
+  if (!handle_finished_header(state) ||
+      !dump_header(state, HEADER_CONNECTION, HEADER_CONNECTION_KEEP_ALIVE)) {
     state->parse_error = true;
     return 1;
   }
@@ -358,26 +454,118 @@ static int handle_request_body(http_parser* parser,
   return 0;
 }
 
+/**
+ * Marks request to target complete, so target connection can be reused,
+ * when request is sent and response is received.
+ */
+static void finish_target_request(client_state_t* state) {
+  int error;
+
+  if (state->target == NULL)
+    return;
+
+  error = pthread_mutex_lock(&state->target->lock);
+  if (error) {
+    proxy_error(error, "Cannot lock target to finish request");
+    return;
+  }
+
+  state->target->request_complete = true;
+  pthread_mutex_unlock(&state->target->lock);
+}
+
+/**
+ * Handles request end.
+ * Parser is paused, so pipelined request is parsed after response.
+ */
+static int handle_request_message_complete(http_parser* parser) {
+  client_state_t* state = (client_state_t*)parser->data;
+
+  state->request_complete = true;
+  finish_target_request(state);
+  state->keep_alive = http_should_keep_alive(parser);
+  http_parser_pause(parser, 1);
+
+  return 0;
+}
+
 static http_parser_settings http_request_callbacks = {
-    NULL, /* on_message_begin */
+    handle_request_message_begin,
     handle_request_url,
     NULL, /* on_status */
     handle_request_header_field,
     handle_request_header_value,
     handle_request_headers_complete,
     handle_request_body,
+    handle_request_message_complete,
+    NULL, /* on_chunk_header */
+    NULL  /* on_chunk_complete */
+};
+
+/**
+ * Handles response headers, which are sent to client.
+ * Parser is paused, since response body is not inspected.
+ */
+static int handle_response_headers_complete(http_parser* parser) {
+  client_state_t* state = (client_state_t*)parser->data;
+
+  // Client sees the same headers, so it keeps connection too
+  state->response_inspected = true;
+  state->response_persistent = http_should_keep_alive(parser);
+  http_parser_pause(parser, 1);
+
+  return 0;
+}
+
+static http_parser_settings http_response_callbacks = {
+    NULL, /* on_message_begin */
+    NULL, /* on_url */
+    NULL, /* on_status */
+    NULL, /* on_header_field */
+    NULL, /* on_header_value */
+    handle_response_headers_complete,
+    NULL, /* on_body */
     NULL, /* on_message_complete */
     NULL, /* on_chunk_header */
     NULL  /* on_chunk_complete */
 };
 
+static bool finish_exchange(client_state_t* state);
+
+/**
+ * Parses client input.
+ * Input after complete request is kept until response is sent.
+ *
+ * @return {@code false} if client connection must be closed.
+ */
+static bool parse_input(client_state_t* state, const char* buff, size_t len) {
+  size_t nparsed =
+      http_parser_execute(&state->parser, &http_request_callbacks, buff, len);
+
+  if (state->parse_error || (nparsed != len && !state->request_complete)) {
+    fprintf(stderr, "Cannot parse http input from client socket\n");
+    return false;
+  }
+
+  if (!state->request_complete)
+    return true;
+
+  if (!pstring_append(&state->pending_input, buff + nparsed, len - nparsed)) {
+    perror("Cannot store pipelined client request");
+    return false;
+  }
+
+  // Next request is read, when response is sent
+  sockets_cancel_in_handle(state->socket);
+  return !state->response_complete || finish_exchange(state);
+}
+
 /**
  * Handles client input data.
  */
 static bool client_input_handler(client_state_t* state) {
   char buff[BUFFER_SIZE];
   ssize_t result;
-  size_t nparsed;
 
   result = recv(state->socket, buff, BUFFER_SIZE, 0);
 
@@ -387,128 +575,258 @@ static bool client_input_handler(client_state_t* state) {
       return false;
     }
     return true;
-  } else if (result == 0)
-    return true;
+  } else if (result == 0) {
+    // Response to complete request is still sent
+    state->input_closed = true;
+    sockets_cancel_in_handle(state->socket);
+    return state->request_complete;
+  }
 
-  nparsed = http_parser_execute(&state->parser, &http_request_callbacks, buff,
-                                result);
-  if (nparsed != result || state->parse_error) {
-    fprintf(stderr, "Cannot parse http input from client socket\n");
+  return parse_input(state, buff, (size_t)result);
+}
+
+/**
+ * Drops sent data from client slices and releases sent segments.
+ */
+static void consume_slices(client_state_t* state, size_t len) {
+  int sent = 0;
+
+  while (sent < state->slices_count && len >= state->slices[sent].len) {
+    len -= state->slices[sent].len;
+    cache_segment_release(state->slices[sent].segment);
+    sent++;
+  }
+
+  if (sent < state->slices_count) {
+    state->slices[sent].data += len;
+    state->slices[sent].len -= len;
+  }
+
+  state->slices_count -= sent;
+  memmove(state->slices, state->slices + sent,
+          state->slices_count * sizeof(cache_slice_t));
+}
+
+/**
+ * Prepares client for next request on the same connection.
+ * Pipelined request is parsed at once.
+ *
+ * @return {@code false} if client connection must be closed.
+ */
+static bool reset_client(client_state_t* state) {
+  pstring_t pending = state->pending_input;
+
+  cache_entry_unsubscribe(state->cache, state->reader);
+  cache_entry_release(state->cache);
+  proxy_release_target(state->target);
+  pstring_free(&state->target_outbuff);
+  pstring_free(&state->url);
+  pstring_free(&state->header_key);
+  pstring_free(&state->header_value);
+
+  state->cache = NULL;
+  state->reader = NULL;
+  state->cache_offset = 0;
+  state->target = NULL;
+  state->url_dumped = false;
+  state->parse_error = false;
+  state->use_cache = false;
+  state->request_complete = false;
+  state->response_complete = false;
+  state->keep_alive = false;
+  state->response_inspected = false;
+  state->response_persistent = false;
+  pstring_init(&state->pending_input);
+  http_parser_init(&state->parser, HTTP_REQUEST);
+  http_parser_init(&state->response_parser, HTTP_RESPONSE);
+
+  client_wait_request(state);
+  sockets_enable_in_handle(state->socket);
+
+  bool result =
+      pending.len == 0 || parse_input(state, pending.str, pending.len);
+  pstring_free(&pending);
+  return result;
+}
+
+/**
+ * Finishes request, which response is sent.
+ * Connection is kept, if both client and response allow it.
+ *
+ * @return {@code false} if client connection must be closed.
+ */
+static bool finish_exchange(client_state_t* state) {
+  if (!state->keep_alive || !state->response_persistent ||
+      state->input_closed)
     return false;
+
+  proxy_log("Keep client socket %d alive", state->socket);
+  return reset_client(state);
+}
+
+/**
+ * Inspects response headers in acquired slices, so it is known,
+ * if response end can be found by client.
+ */
+static void inspect_response(client_state_t* state) {
+  for (int i = 0; i < state->slices_count && !state->response_inspected;
+       i++) {
+    http_parser_execute(&state->response_parser, &http_response_callbacks,
+                        state->slices[i].data, state->slices[i].len);
+
+    // Response with broken headers is not persistent
+    if (HTTP_PARSER_ERRNO(&state->response_parser) != HPE_OK &&
+        !state->response_inspected)
+      state->response_inspected = true;
   }
+}
 
-  return true;
+/**
+ * Switches client to stale entry, which was revalidated instead of
+ * current cache entry.
+ *
+ * @return {@code true} if success.
+ */
+static bool use_revalidated_entry(client_state_t* state) {
+  cache_entry_t* entry = state->cache->stale;
+
+  cache_entry_unsubscribe(state->cache, state->reader);
+  cache_entry_retain(entry);
+  cache_entry_release(state->cache);
+
+  state->cache = entry;
+  state->cache_offset = 0;
+  state->reader = cache_entry_subscribe(entry, &accept_cache_updates, state);
+
+  return state->reader != NULL;
 }
 
 /**
  * Handles client output data.
+ * Data is sent directly from cache segments.
  */
 static bool client_output_handler(client_state_t* state) {
-  char buff[BUFFER_SIZE];
+  struct iovec iov[PROXY_CLIENT_SLICES];
+  ssize_t result;
 
-  if (state->cache == NULL)
+  // Output is enabled again, when cache entry is found
+  if (state->cache == NULL) {
+    sockets_cancel_out_handle(state->socket);
     return true;
+  }
 
-  ssize_t len =
-      cache_entry_extract(state->cache, state->cache_offset, buff, BUFFER_SIZE);
-  if (len == -1)
-    return false;
+  while (true) {
+    if (state->slices_count == 0) {
+      // Updates received after this point will enable output again
+      __atomic_store_n(&state->cache_updates, false, __ATOMIC_SEQ_CST);
+
+      // Checked before acquire, so data appended before finish is not lost
+      bool finished = state->cache->finished;
+      int count = cache_entry_acquire(state->cache, state->cache_offset,
+                                      state->slices, PROXY_CLIENT_SLICES);
+      if (count == -1)
+        return false;
+
+      if (count == 0) {
+        if (finished && state->cache->revalidated) {
+          if (!use_revalidated_entry(state))
+            return false;
+          continue;
+        }
+        if (finished) {
+          sockets_cancel_out_handle(state->socket);
+          if (state->request_complete)
+            return finish_exchange(state);
+
+          // Rest of request is read before next one
+          state->response_complete = true;
+          sockets_enable_in_handle(state->socket);
+          return true;
+        }
+        sockets_cancel_out_handle(state->socket);
+        if (__atomic_load_n(&state->cache_updates, __ATOMIC_SEQ_CST))
+          sockets_enable_out_handle(state->socket);
+        return true;
+      }
 
-  if (len == 0) {
-    if (state->cache->finished)
-      return false;
-    if (!state->cache_updates)
-      sockets_cancel_out_handle(state->socket);
-    return true;
-  }
+      state->slices_count = count;
+      for (int i = 0; i < count; i++)
+        state->cache_offset += state->slices[i].len;
+      inspect_response(state);
+    }
 
-  state->cache_offset += len;
-  if (!pstring_append(&state->client_outbuff, buff, len))
-    return false;
+    for (int i = 0; i < state->slices_count; i++) {
+      iov[i].iov_base = (void*)state->slices[i].data;
+      iov[i].iov_len = state->slices[i].len;
+    }
+
+    result = writev(state->socket, iov, state->slices_count);
+    if (result == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+      perror("Cannot send data to client");
+      return false;
+    }
 
-  int value = send_pstring(state->socket, &state->client_outbuff);
-  return value != -1;
+    consume_slices(state, (size_t)result);
+  }
 }
 
 /**
  * Cleanup all client data.
  */
 static void client_cleanup(client_state_t* state) {
-  pthread_mutex_unlock(&state->lock);
   sockets_remove_socket(state->socket);
   cache_entry_unsubscribe(state->cache, state->reader);
-  pstring_free(&state->client_outbuff);
+  cache_entry_release(state->cache);
+  proxy_release_target(state->target);
+  consume_slices(state, SIZE_MAX);
   pstring_free(&state->target_outbuff);
   pstring_free(&state->url);
   pstring_free(&state->header_key);
   pstring_free(&state->header_value);
-  pthread_cond_destroy(&state->notifier);
-  pthread_mutex_destroy(&state->lock);
+  pstring_free(&state->pending_input);
   free(state);
 }
 
-static bool client_init(client_state_t* state) {
-  int error;
+bool client_task_run(void* arg, int events) {
+  client_state_t* state = (client_state_t*)arg;
 
-  if (!sockets_add_socket(state->socket, &client_handler, state)) {
+  // Timeout can expire just before request start
+  if (events & SOCKETS_TIMEOUT && !state->request_started) {
+    proxy_log("Close idle client socket %d", state->socket);
     client_cleanup(state);
     return false;
   }
-  sockets_enable_io_handle(state->socket);
 
-  error = pthread_mutex_lock(&state->lock);
-  if (error) {
-    proxy_error(error, "Cannot lock client lock");
-    client_cleanup(state);
-    return false;
-  }
-
-  return true;
-}
-
-void* client_thread(void* arg) {
-  client_state_t* state = (client_state_t*)arg;
-  int events, error;
-
-  if (!client_init(state))
-    return NULL;
-
-  while (1) {
-    error = pthread_cond_wait(&state->notifier, &state->lock);
-    if (error) {
-      proxy_error(error, "Cannot wait client condition");
+  // Handle output
+  if (events & POLLOUT) {
+    if (!client_output_handler(state)) {
       client_cleanup(state);
-      return NULL;
-    }
-    events = state->revents;
-
-    // Handle output
-    if (events & POLLOUT) {
-      if (!client_output_handler(state)) {
-        client_cleanup(state);
-        return NULL;
-      }
-    }
-
-    // Handle input
-    if (events & (POLLIN | POLLPRI)) {
-      if (!client_input_handler(state)) {
-        client_cleanup(state);
-        return NULL;
-      }
+      return false;
     }
+  }
 
-    // Handle hup
-    if (events & POLLHUP) {
+  // Handle input
+  if (events & (POLLIN | POLLPRI)) {
+    if (!client_input_handler(state)) {
       client_cleanup(state);
-      return NULL;
+      return false;
     }
   }
+
+  // Handle hup
+  if (events & (POLLHUP | POLLERR)) {
+    client_cleanup(state);
+    return false;
+  }
+
+  sockets_resume_handle(state->socket);
+  return true;
 }
 
 void client_handler(int socket, int events, void* arg) {
   client_state_t* state = (client_state_t*)arg;
 
-  state->revents = events;
-  pthread_cond_signal(&state->notifier);
+  worker_pool_submit(&state->task, events);
 }
@@ -1,15 +1,36 @@
+#include <stdbool.h>
+
+#include "proxy-handler.h"
 
 #ifndef _PROXY_CLIENT_HANDLER_H
 #define _PROXY_CLIENT_HANDLER_H
 
+/**
+ * Initializes clients handling settings.
+ *
+ * @param keep_alive_timeout Milliseconds, while client connection
+ * waits for next request.
+ */
+void client_handler_init(long keep_alive_timeout);
+
+/**
+ * Starts waiting for client request. Connection is closed,
+ * if request is not started during keep-alive timeout.
+ *
+ * @param state Added client.
+ */
+void client_wait_request(client_state_t* state);
+
 /**
  * Callback for input data from client.
  */
 void client_handler(int socket, int events, void* arg);
 
 /**
- * Client thread routine.
+ * Handles client socket events in worker thread.
+ *
+ * @return {@code false} if client state destroyed.
  */
-void* client_thread(void* arg);
+bool client_task_run(void* arg, int events);
 
 #endif
@@ -11,180 +11,373 @@
 #include "proxy-client-handler.h"
 #include "proxy-target-handler.h"
 #include "proxy-utils.h"
+#include "resolver.h"
 #include "sockets-handler.h"
+#include "target-pool.h"
 
 #include "proxy-handler.h"
 
 #define BLOCKED_TLS_PORT "443"
+#define DEFAULT_PORT "http"
+#define URL_SCHEME_DELIM "://"
+#define REVALIDATION_LINE_START "GET "
+#define REVALIDATION_LINE_END " HTTP/1.0\r\n"
+#define HEADER_HOST "Host"
+#define LINE_DELIM "\r\n"
 
-void proxy_accept_client(int socket) {
-  pthread_attr_t attr;
-  int error;
+#define DEF_LEN(str) (sizeof(str) - 1)
+
+static long connect_timeout;
+
+void proxy_init(long timeout, long keep_alive_timeout) {
+  connect_timeout = timeout;
+  client_handler_init(keep_alive_timeout);
+}
 
+void proxy_accept_client(int socket) {
   client_state_t* state = (client_state_t*)calloc(1, sizeof(client_state_t));
   if (state == NULL) {
     perror("Cannot allocate state for connection");
-    goto error_malloc;
+    close(socket);
+    return;
   }
 
-  error = pthread_mutex_init(&state->lock, NULL);
-  if (error) {
-    proxy_error(error, "Cannot create mutex for client");
-    goto error_mutex;
+  state->socket = socket;
+  http_parser_init(&state->parser, HTTP_REQUEST);
+  state->parser.data = state;
+  http_parser_init(&state->response_parser, HTTP_RESPONSE);
+  state->response_parser.data = state;
+  worker_task_init(&state->task, &client_task_run, state);
+
+  if (!sockets_add_socket(socket, &client_handler, state)) {
+    free(state);
+    close(socket);
+    return;
   }
+  client_wait_request(state);
+  sockets_enable_io_handle(socket);
+}
 
-  error = pthread_cond_init(&state->notifier, NULL);
-  if (error) {
-    proxy_error(error, "Cannot create condition for client");
-    goto error_cond;
+/**
+ * Splits "hostname[:port]" target name.
+ *
+ * @param host Target name.
+ * @param port Port or service name part of target name.
+ *
+ * @return Allocated hostname or {@code NULL}.
+ */
+static char* split_host(const char* host, const char** port) {
+  const char* split_pos = strrchr(host, ':');
+
+  if (split_pos == NULL) {
+    (*port) = DEFAULT_PORT;
+    return strdup(host);
   }
 
-  error = pthread_attr_init(&attr);
-  if (error) {
-    proxy_error(error, "Cannot create client thread attrs");
-    goto error_attr;
+  (*port) = split_pos + 1;
+  return strndup(host, (size_t)(split_pos - host));
+}
+
+/**
+ * Starts handling of connected target socket.
+ * Socket is closed, if it cannot be handled.
+ *
+ * @return {@code true} if success.
+ */
+static bool attach_target(target_state_t* target, int socket) {
+  // Client can enable output while socket is set
+  pthread_mutex_lock(&target->lock);
+  target->socket = socket;
+  target->reused = true;
+  bool result = sockets_add_socket(socket, &target_handler, target);
+  if (!result)
+    target->socket = -1;
+  pthread_mutex_unlock(&target->lock);
+
+  if (!result) {
+    close(socket);
+    return false;
   }
-  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-  state->socket = socket;
-  http_parser_init(&state->parser, HTTP_REQUEST);
-  state->parser.data = state;
+  sockets_enable_io_handle(socket);
+  return true;
+}
 
-  error = pthread_create(&state->thread, &attr, &client_thread, state);
-  if (error) {
-    proxy_error(error, "Cannot create client thread");
-    goto error_thread;
-  }
+/**
+ * Starts connection attempts to resolved addresses.
+ * Target handler finishes connection, when some attempt succeeds
+ * or all of them fail.
+ *
+ * @return {@code true} if connecting started.
+ */
+static bool connect_resolved(target_state_t* target,
+                             resolver_result_t* result) {
+  if (result == NULL)
+    return false;
 
-  return;
-
-error_thread:
-  pthread_attr_destroy(&attr);
-error_attr:
-  pthread_cond_destroy(&state->notifier);
-error_cond:
-  pthread_mutex_destroy(&state->lock);
-error_mutex:
-  free(state);
-error_malloc:
-  close(socket);
-}
-
-static int connect_target(char* host) {
-  struct addrinfo hints, *result;
-  char* split_pos = strrchr(host, ':');
-  int sock = -1;
-  char* hostname = host;
-  char* port = "http";
-  if (split_pos != NULL) {
-    hostname = (char*)malloc((size_t)(split_pos - host + 1));
-    memcpy(hostname, host, (size_t)(split_pos - host));
-    hostname[split_pos - host] = '\0';
-    port = host + (split_pos - host) + 1;
+  if (result->error) {
+    fprintf(stderr, "Cannot resolve %s: %s\n", target->host,
+            gai_strerror(result->error));
+    return false;
   }
 
-  if (!strncmp(port, BLOCKED_TLS_PORT, sizeof(BLOCKED_TLS_PORT) - 1)) {
-    proxy_log("Ignore TLS connection to %s\n", host);
-    if (hostname != host)
-      free(hostname);
-    return -1;
-  }
+  // Attempts can become ready before connector is started
+  pthread_mutex_lock(&target->lock);
+  target->connecting = true;
+  bool started =
+      target_connector_start(&target->connector, result, connect_timeout,
+                             &target_attempt_handler, target);
+  if (!started)
+    proxy_error(target->connector.error, "Cannot connect to %s",
+                target->host);
+  pthread_mutex_unlock(&target->lock);
+
+  return started;
+}
 
-  proxy_log("Connecting to %s...", host);
+/**
+ * Continues target connection, when its name is resolved.
+ */
+static void handle_target_resolved(resolver_result_t* result, void* arg) {
+  target_state_t* target = (target_state_t*)arg;
 
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_family = PF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  int error = getaddrinfo(hostname, port, &hints, &result);
-  if (error) {
-    fprintf(stderr, "Cannot resolve %s: %s\n", host, gai_strerror(error));
-    if (hostname != host)
-      free(hostname);
-    return -1;
+  bool connected = connect_resolved(target, result);
+  resolver_result_release(result);
+
+  if (!connected)
+    target_connection_failed(target);
+}
+
+/**
+ * Connects target with idle connection or new one.
+ * Target name is resolved in background, if it is not cached,
+ * then connection failure is handled by target itself.
+ *
+ * @param reuse Idle connection can be used.
+ *
+ * @return {@code false} if target cannot be connected.
+ */
+static bool connect_target(target_state_t* target, bool reuse) {
+  resolver_result_t* result;
+  const char* port;
+
+  char* hostname = split_host(target->host, &port);
+  if (hostname == NULL) {
+    perror("Cannot split target host");
+    return false;
   }
 
-  sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
-  if (sock < 0) {
-    perror("Cannot create target socket");
-    goto cleanup;
+  if (!strncmp(port, BLOCKED_TLS_PORT, DEF_LEN(BLOCKED_TLS_PORT))) {
+    proxy_log("Ignore TLS connection to %s\n", target->host);
+    free(hostname);
+    return false;
   }
 
-  if (connect(sock, result->ai_addr, result->ai_addrlen) < 0) {
-    perror("Cannot connect to target");
-    close(sock);
-    sock = -1;
-    goto cleanup;
+  int socket = reuse ? target_pool_acquire(target->host) : -1;
+  if (socket != -1) {
+    proxy_log("Reuse connection to %s with socket %d", target->host, socket);
+    free(hostname);
+    return attach_target(target, socket);
   }
 
-  proxy_log("Connected to %s with socket %d", host, sock);
+  proxy_log("Connecting to %s...", target->host);
 
-cleanup:
-  if (hostname != host)
-    free(hostname);
-  freeaddrinfo(result);
-  return sock;
+  int status = resolver_resolve(hostname, port, &result,
+                                &handle_target_resolved, target);
+  free(hostname);
+  if (status != 0)
+    return status == 1;
+
+  bool connected = connect_resolved(target, result);
+  resolver_result_release(result);
+
+  return connected;
 }
 
-bool proxy_establish_connection(client_state_t* state, char* host) {
-  pthread_attr_t attr;
+/**
+ * Creates target state for cache entry.
+ *
+ * @param entry Cache entry filled by target response.
+ * @param request Request sent to target.
+ * @param host hostname[:port]
+ * @param skip_body Response has no body, since request method is HEAD.
+ * @param refs Amount of target state owners.
+ *
+ * @return Target state or {@code NULL}.
+ */
+static target_state_t* create_target(cache_entry_t* entry,
+                                     pstring_t* request,
+                                     char* host,
+                                     bool skip_body,
+                                     int refs) {
   int error;
 
-  state->target = (target_state_t*)calloc(1, sizeof(target_state_t));
-  if (state->target == NULL) {
+  target_state_t* target = (target_state_t*)calloc(1, sizeof(target_state_t));
+  if (target == NULL) {
     perror("Cannot allocate target state");
-    return false;
+    return NULL;
   }
 
-  error = pthread_mutex_init(&state->target->lock, NULL);
+  error = pthread_mutex_init(&target->lock, NULL);
   if (error) {
     proxy_error(error, "Cannot create mutex for target");
-    goto error_mutex;
+    free(target);
+    return NULL;
   }
 
-  error = pthread_cond_init(&state->target->notifier, NULL);
-  if (error) {
-    proxy_error(error, "Cannot create condition for target");
-    goto error_cond;
+  target->host = strdup(host);
+  if (target->host == NULL) {
+    perror("Cannot duplicate target host");
+    pthread_mutex_destroy(&target->lock);
+    free(target);
+    return NULL;
   }
 
-  error = pthread_attr_init(&attr);
-  if (error) {
-    proxy_error(error, "Cannot create target thread attrs");
-    goto error_attr;
+  target->socket = -1;
+  target->refs = refs;
+  http_parser_init(&target->parser, HTTP_RESPONSE);
+  target->parser.data = target;
+  target->skip_body = skip_body;
+  cache_control_init(&target->control);
+  target->cache = entry;
+  cache_entry_retain(entry);
+  worker_task_init(&target->task, &target_task_run, target);
+  pstring_init(&target->outbuff);
+  pstring_replace(&target->outbuff, request->str, request->len);
+
+  return target;
+}
+
+/**
+ * Frees target state, which was not connected.
+ */
+static void destroy_target(target_state_t* target) {
+  target_connector_free(&target->connector);
+  cache_entry_release(target->cache);
+  cache_control_free(&target->control);
+  pstring_free(&target->outbuff);
+  pstring_free(&target->sent);
+  free(target->host);
+  pthread_mutex_destroy(&target->lock);
+  free(target);
+}
+
+void proxy_release_target(target_state_t* target) {
+  if (target == NULL)
+    return;
+
+  if (__atomic_sub_fetch(&target->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    pthread_mutex_destroy(&target->lock);
+    free(target);
   }
-  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+}
 
-  http_parser_init(&state->target->parser, HTTP_RESPONSE);
-  state->target->parser.data = state->target;
-  state->target->cache = state->cache;
-  pstring_init(&state->target->outbuff);
-  pstring_replace(&state->target->outbuff, state->target_outbuff.str,
-                  state->target_outbuff.len);
+bool proxy_reconnect_target(target_state_t* target) {
+  return connect_target(target, false);
+}
 
-  if ((state->target->socket = connect_target(host)) < 0)
-    goto error_socket;
+bool proxy_establish_connection(client_state_t* state, char* host) {
+  // Target is owned by client too, while it sends request
+  target_state_t* target =
+      create_target(state->cache, &state->target_outbuff, host,
+                    state->parser.method == HTTP_HEAD, 2);
+  if (target == NULL)
+    return false;
 
-  error = pthread_create(&state->target->thread, &attr, &target_thread,
-                         state->target);
-  if (error) {
-    proxy_error(error, "Cannot create target thread");
-    goto error_socket;
+  if (!connect_target(target, true)) {
+    destroy_target(target);
+    return false;
   }
 
+  state->target = target;
   return true;
+}
+
+/**
+ * Appends header line to request buffer.
+ *
+ * @return {@code true} if success.
+ */
+static bool append_header(pstring_t* buff, const char* key, const char* value) {
+  pstring_t key_str = {strlen(key), (char*)key};
+  pstring_t value_str = {strlen(value), (char*)value};
+  size_t len;
+
+  char* line = build_header_string(&key_str, &value_str, &len);
+  if (line == NULL)
+    return false;
+
+  bool result = pstring_append(buff, line, len);
+  free(line);
+
+  return result;
+}
+
+bool proxy_append_validators(pstring_t* buff, cache_entry_t* stale) {
+  if (stale->etag != NULL &&
+      !append_header(buff, HEADER_IF_NONE_MATCH, stale->etag))
+    return false;
+
+  if (stale->last_modified != NULL &&
+      !append_header(buff, HEADER_IF_MODIFIED_SINCE, stale->last_modified))
+    return false;
+
+  return true;
+}
+
+/**
+ * Builds conditional GET request for stale entry.
+ *
+ * @return {@code true} if success.
+ */
+static bool build_revalidation(pstring_t* request,
+                               cache_entry_t* stale,
+                               char* host) {
+  // Entries of absolute and relative URLs are both named by absolute ones
+  char* path = strstr(stale->url, URL_SCHEME_DELIM);
+  path = path != NULL ? strchr(path + DEF_LEN(URL_SCHEME_DELIM), '/') : NULL;
+  if (path == NULL)
+    return false;
+
+  return pstring_append(request, REVALIDATION_LINE_START,
+                        DEF_LEN(REVALIDATION_LINE_START)) &&
+         pstring_append(request, path, strlen(path)) &&
+         pstring_append(request, REVALIDATION_LINE_END,
+                        DEF_LEN(REVALIDATION_LINE_END)) &&
+         append_header(request, HEADER_HOST, host) &&
+         append_header(request, HEADER_CONNECTION,
+                       HEADER_CONNECTION_KEEP_ALIVE) &&
+         proxy_append_validators(request, stale) &&
+         pstring_append(request, LINE_DELIM, DEF_LEN(LINE_DELIM));
+}
+
+bool proxy_revalidate(cache_entry_t* stale, char* host) {
+  pstring_t request;
+
+  cache_entry_t* entry = cache_entry_create_revalidation(stale);
+  if (entry == NULL)
+    return false;
+
+  pstring_init(&request);
+  bool result = build_revalidation(&request, stale, host);
+  if (!result) {
+    perror("Cannot build revalidation request");
+  } else {
+    target_state_t* target = create_target(entry, &request, host, false, 1);
+    if (target != NULL)
+      target->request_complete = true;
+    result = target != NULL && connect_target(target, true);
+    if (target != NULL && !result)
+      destroy_target(target);
+  }
+  pstring_free(&request);
+
+  // Target keeps its own reference of entry
+  if (!result)
+    cache_entry_mark_invalid_and_finished(entry);
+  cache_entry_release(entry);
 
-error_socket:
-  pstring_free(&state->target->outbuff);
-  pthread_attr_destroy(&attr);
-error_attr:
-  pthread_cond_destroy(&state->target->notifier);
-error_cond:
-  pthread_mutex_destroy(&state->target->lock);
-error_mutex:
-  free(state->target);
-  state->target = NULL;
-
-  return false;
+  return result;
 }
 
 int send_pstring(int socket, pstring_t* buff) {
@@ -2,29 +2,34 @@
 #include <pthread.h>
 #include <stdbool.h>
 
+#include "cache-control.h"
 #include "cache.h"
 #include "http-parser.h"
 #include "pstring.h"
+#include "target-connector.h"
+#include "worker-pool.h"
 
 #ifndef _PROXY_HANDLER_H
 #define _PROXY_HANDLER_H
 
 #define PROXY_HTTP_RESPONSE_VALID_LINE_LEN sizeof("HTTP/1.0 200") - 1
+#define HEADER_CONNECTION "Connection"
+#define HEADER_CONNECTION_KEEP_ALIVE "keep-alive"
+#define HEADER_IF_NONE_MATCH "If-None-Match"
+#define HEADER_IF_MODIFIED_SINCE "If-Modified-Since"
+// Maximum amount of cache segments sent to client at once
+#define PROXY_CLIENT_SLICES 16
 
 struct target_state;
 
 typedef struct client_state {
   int socket;
-  volatile int revents;
+  worker_task_t task;
   volatile bool cache_updates;
   http_parser parser;
   bool parse_error;
-  pthread_mutex_t lock;
-  pthread_cond_t notifier;
-  pthread_t thread;
   pstring_t url;
   bool url_dumped;
-  pstring_t client_outbuff;
   pstring_t target_outbuff;
   pstring_t header_key;
   pstring_t header_value;
@@ -32,21 +37,60 @@ typedef struct client_state {
   cache_entry_reader_t* reader;
   cache_entry_t* cache;
   size_t cache_offset;
+  cache_slice_t slices[PROXY_CLIENT_SLICES];
+  int slices_count;
   bool use_cache;
+  bool request_complete;
+  bool response_complete;
+  bool keep_alive;
+  bool input_closed;
+  pstring_t pending_input;
+  http_parser response_parser;
+  bool response_inspected;
+  bool response_persistent;
+  bool request_started;
 } client_state_t;
 
 typedef struct target_state {
   int socket;
-  volatile int revents;
+  int refs;
+  worker_task_t task;
   http_parser parser;
   pthread_mutex_t lock;
-  pthread_cond_t notifier;
-  pthread_t thread;
+  char* host;
   pstring_t outbuff;
+  // Request sent with reused connection, until response is started
+  pstring_t sent;
+  bool reused;
+  bool response_started;
+  pstring_t header_key;
+  pstring_t header_value;
+  bool header_value_started;
+  cache_control_t control;
+  bool headers_complete;
+  bool storable;
+  bool revalidated;
+  bool stale_used;
+  bool skip_body;
   cache_entry_t* cache;
   bool message_complete;
+  bool request_complete;
+  bool reusable;
+  bool closed;
+  bool connecting;
+  target_connector_t connector;
 } target_state_t;
 
+/**
+ * Initializes proxying settings.
+ *
+ * @param connect_timeout Milliseconds, while connection to target
+ * is established.
+ * @param keep_alive_timeout Milliseconds, while client connection
+ * waits for next request.
+ */
+void proxy_init(long connect_timeout, long keep_alive_timeout);
+
 /**
  * Accepts new client at required socket.
  *
@@ -56,15 +100,59 @@ void proxy_accept_client(int socket);
 
 /**
  * Establish connection to proxying target at required hostname and port.
+ * Idle persistent connection to the target is reused, if it exists.
+ * Target name is resolved in background, if it is not cached yet.
  * Also creates target input handler and parser.
  *
  * @param state Current state.
  * @param host hostname[:port]
  *
- * @return {@code true} if successfully established.
+ * @return {@code true} if successfully established or resolving started.
  */
 bool proxy_establish_connection(client_state_t* state, char* host);
 
+/**
+ * Releases target state reference.
+ * Target state is freed, when both client and target release it.
+ *
+ * @param target Target state or {@code NULL}.
+ */
+void proxy_release_target(target_state_t* target);
+
+/**
+ * Connects target again with new connection, when reused one fails.
+ * Target name is resolved in background, if it is not cached,
+ * then connection failure is reported to target task.
+ *
+ * @param target Target state without socket.
+ *
+ * @return {@code false} if target cannot be connected.
+ */
+bool proxy_reconnect_target(target_state_t* target);
+
+/**
+ * Revalidates expired cache entry in background.
+ * Entry is replaced by new response or its freshness is updated,
+ * current readers are not affected.
+ *
+ * @param stale Expired cache entry.
+ * @param host hostname[:port]
+ *
+ * @return {@code true} if revalidation request is sent.
+ */
+bool proxy_revalidate(cache_entry_t* stale, char* host);
+
+/**
+ * Appends conditional request headers with validators of stale entry,
+ * so target answers with not modified response, if entry is still valid.
+ *
+ * @param buff Target request buffer.
+ * @param stale Stale cache entry.
+ *
+ * @return {@code true} if success.
+ */
+bool proxy_append_validators(pstring_t* buff, cache_entry_t* stale);
+
 /**
  * Sends string to the socket.
  *
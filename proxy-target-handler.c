@@ -5,22 +5,150 @@
 #include <string.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "proxy-handler.h"
 #include "proxy-utils.h"
 #include "sockets-handler.h"
+#include "target-pool.h"
+#include "worker-pool.h"
 
 #include "proxy-target-handler.h"
 
 #define BUFFER_SIZE 4096
+#define HTTP_NOT_MODIFIED 304
+#define HTTP_SERVER_ERROR 500
+// Reported to target task by connection attempts
+#define TARGET_ATTEMPT_EVENT 0x20000
+// Reported to target task, when target cannot be connected in background
+#define TARGET_FAILURE_EVENT 0x40000
 
 /**
- * Handles target response initial line.
+ * Applies buffered response header to response caching headers.
+ */
+static void handle_finished_header(target_state_t* state) {
+  if (!state->header_value_started)
+    return;
+
+  pstring_finalize(&state->header_key);
+  pstring_finalize(&state->header_value);
+  if (state->header_key.str != NULL)
+    cache_control_parse_header(&state->control, state->header_key.str,
+                               state->header_value.str);
+
+  pstring_free(&state->header_key);
+  pstring_free(&state->header_value);
+  state->header_value_started = false;
+}
+
+/**
+ * Handles response header field input data.
+ */
+static int handle_response_header_field(http_parser* parser,
+                                        const char* at,
+                                        size_t len) {
+  target_state_t* state = (target_state_t*)parser->data;
+
+  handle_finished_header(state);
+
+  if (!pstring_append(&state->header_key, at, len)) {
+    perror("Cannot store target header key");
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Handles response header value input data.
+ */
+static int handle_response_header_value(http_parser* parser,
+                                        const char* at,
+                                        size_t len) {
+  target_state_t* state = (target_state_t*)parser->data;
+
+  state->header_value_started = true;
+  if (!pstring_append(&state->header_value, at, len)) {
+    perror("Cannot store target header value");
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Decides, if response is stored or stale entry is revalidated,
+ * and computes its freshness.
+ */
+static void apply_response_headers(target_state_t* state, int status_code) {
+  cache_entry_t* stale = state->cache->stale;
+  cache_freshness_t freshness;
+
+  // Response to HEAD request has no body to store or to replace stale one
+  if (state->skip_body) {
+    state->storable = false;
+    cache_entry_mark_invalid(state->cache);
+    return;
+  }
+
+  if (status_code == HTTP_NOT_MODIFIED && stale != NULL) {
+    state->revalidated = true;
+
+    // Stored freshness is kept, if not modified response has no own one
+    cache_control_freshness(&state->control, time(NULL), &stale->freshness,
+                            &freshness);
+    cache_entry_set_freshness(state->cache, &freshness);
+    return;
+  }
+
+  // Server error is hidden by stale response (RFC 5861 4)
+  if (status_code >= HTTP_SERVER_ERROR &&
+      cache_entry_stale_usable(state->cache, false)) {
+    state->stale_used = true;
+    return;
+  }
+
+  state->storable =
+      status_code == 200 && cache_control_storable(&state->control);
+
+  // New clients must not join response, which is not stored
+  if (!state->storable) {
+    cache_entry_mark_invalid(state->cache);
+    return;
+  }
+
+  cache_control_freshness(&state->control, time(NULL), NULL, &freshness);
+  cache_entry_set_freshness(state->cache, &freshness);
+  cache_entry_set_validators(state->cache, state->control.etag,
+                             state->control.last_modified_header);
+}
+
+/**
+ * Handles response headers complete part.
+ */
+static int handle_response_headers_complete(http_parser* parser) {
+  target_state_t* state = (target_state_t*)parser->data;
+
+  handle_finished_header(state);
+  state->headers_complete = true;
+  apply_response_headers(state, parser->status_code);
+
+  // Response to HEAD request has no body, despite its Content-Length
+  return state->skip_body;
+}
+
+/**
+ * Handles target response end.
+ * Parser is paused, so data after response is not parsed.
  */
 static int handle_response_message_complete(http_parser* parser) {
   target_state_t* state = (target_state_t*)parser->data;
+
   state->message_complete = true;
+  state->reusable = http_should_keep_alive(parser);
+  http_parser_pause(parser, 1);
+
   return 0;
 }
 
@@ -28,9 +156,9 @@ static http_parser_settings http_response_callbacks = {
     NULL, /* on_message_begin */
     NULL, /* on_url */
     NULL, /* on_response_status */
-    NULL, /* on_header_field */
-    NULL, /* on_header_value */
-    NULL, /* on_headers_complete */
+    handle_response_header_field,
+    handle_response_header_value,
+    handle_response_headers_complete,
     NULL, /* on_response_body */
     handle_response_message_complete,
     NULL, /* on_chunk_header */
@@ -53,19 +181,38 @@ static int target_input_handler(target_state_t* state) {
       return -1;
     }
     return 0;
-  } else if (result == 0)
-    return 1;
+  } else if (result == 0) {
+    // Response without length is finished by connection close
+    http_parser_execute(&state->parser, &http_response_callbacks, NULL, 0);
+    if (!state->message_complete) {
+      fprintf(stderr, "Target closed connection before response end\n");
+      return -1;
+    }
+    return 0;
+  }
 
-  if (state->parser.status_code == 0) {
-    nparsed = http_parser_execute(&state->parser, &http_response_callbacks,
-                                  buff, result);
-    if (nparsed != result) {
+  // Request cannot be sent again, when response is started
+  state->response_started = true;
+  pstring_free(&state->sent);
+
+  // Whole response is parsed to find its end on persistent connection
+  nparsed = http_parser_execute(&state->parser, &http_response_callbacks,
+                                buff, result);
+  if (nparsed != result) {
+    if (!state->message_complete) {
       fprintf(stderr, "Cannot parse http input from target socket\n");
       return -1;
     }
+
+    // Target sent more than response, so connection state is unknown
+    state->reusable = false;
   }
 
-  if (!cache_entry_append(state->cache, buff, result)) {
+  // Not modified and hidden responses are not sent to clients
+  if (state->revalidated || state->stale_used)
+    return 0;
+
+  if (!cache_entry_append(state->cache, buff, nparsed)) {
     fprintf(stderr, "Cannot store target data to cache\n");
     return -1;
   }
@@ -73,97 +220,260 @@ static int target_input_handler(target_state_t* state) {
   return 0;
 }
 
+/**
+ * Finishes entry, which target failed to receive.
+ * Stale response is used instead, if nothing is received yet.
+ */
+static void finish_failed_entry(target_state_t* state) {
+  if (state->revalidated)
+    cache_entry_mark_revalidated(state->cache);
+  else if (state->stale_used ||
+           (state->cache->len == 0 &&
+            cache_entry_stale_usable(state->cache, false)))
+    cache_entry_mark_stale_used(state->cache);
+  else
+    cache_entry_mark_invalid_and_finished(state->cache);
+}
+
+/**
+ * Drops client output and connection attempts.
+ * Must be called with target lock held.
+ */
+static void close_target(target_state_t* state) {
+  state->closed = true;
+  pstring_free(&state->outbuff);
+  pstring_free(&state->sent);
+  target_connector_free(&state->connector);
+}
+
+/**
+ * Frees closed target data.
+ * State itself is freed, when client releases it too.
+ *
+ * @param reusable Connection is kept for next request.
+ */
+static void free_target(target_state_t* state, bool reusable) {
+  if (state->socket != -1) {
+    if (reusable && sockets_detach_socket(state->socket))
+      target_pool_release(state->host, state->socket);
+    else
+      sockets_remove_socket(state->socket);
+  }
+
+  free(state->host);
+  cache_entry_release(state->cache);
+  pstring_free(&state->header_key);
+  pstring_free(&state->header_value);
+  cache_control_free(&state->control);
+  proxy_release_target(state);
+}
+
 /**
  * Cleanup all target data.
+ * Must be called with target lock held, which is released.
  */
 static void target_cleanup(target_state_t* state) {
+  // Connection with complete response and sent request is kept for next one
+  bool reusable =
+      state->reusable && state->request_complete && state->outbuff.len == 0;
+
+  // Client output is dropped from now
+  close_target(state);
   pthread_mutex_unlock(&state->lock);
-  sockets_remove_socket(state->socket);
-  pstring_free(&state->outbuff);
-  pthread_cond_destroy(&state->notifier);
-  pthread_mutex_destroy(&state->lock);
-  free(state);
+  free_target(state, reusable);
 }
 
-static bool target_init(target_state_t* state) {
-  int error;
-
-  if (!sockets_add_socket(state->socket, &target_handler, state)) {
+/**
+ * Finishes target, which cannot be connected.
+ * Must be called with target lock held.
+ */
+static void finish_unconnected(target_state_t* state) {
+  // Disconnected cache can serve stale response
+  if (cache_entry_stale_usable(state->cache, true))
+    cache_entry_mark_stale_used(state->cache);
+  else
     cache_entry_mark_invalid_and_finished(state->cache);
-    target_cleanup(state);
-    return false;
-  }
-  sockets_enable_io_handle(state->socket);
 
-  error = pthread_mutex_lock(&state->lock);
-  if (error) {
-    proxy_error(error, "Cannot lock target lock");
-    cache_entry_mark_invalid_and_finished(state->cache);
-    target_cleanup(state);
+  target_cleanup(state);
+}
+
+/**
+ * Starts handling of connected socket.
+ * Must be called with target lock held.
+ *
+ * @return {@code true} if success.
+ */
+static bool attach_connected(target_state_t* state, int socket) {
+  state->connecting = false;
+  if (!sockets_add_socket(socket, &target_handler, state)) {
+    close(socket);
     return false;
   }
 
+  state->socket = socket;
+  sockets_enable_io_handle(socket);
+  proxy_log("Connected to %s with socket %d", state->host, socket);
   return true;
 }
 
-void* target_thread(void* arg) {
+/**
+ * Sends request again with new connection, since target could close
+ * reused connection as idle one before request is received.
+ * Must be called with target lock held, which is released on success.
+ *
+ * @return {@code true} if connecting started.
+ */
+static bool retry_request(target_state_t* state) {
+  // Sent part of request precedes buffered one
+  if (state->outbuff.len > 0 &&
+      !pstring_append(&state->sent, state->outbuff.str, state->outbuff.len))
+    return false;
+  pstring_free(&state->outbuff);
+  state->outbuff = state->sent;
+  pstring_init(&state->sent);
+
+  proxy_log("Retry request to %s with new connection", state->host);
+  sockets_remove_socket(state->socket);
+  state->socket = -1;
+  state->reused = false;
+  http_parser_init(&state->parser, HTTP_RESPONSE);
+  state->parser.data = state;
+  pthread_mutex_unlock(&state->lock);
+
+  if (proxy_reconnect_target(state))
+    return true;
+
+  pthread_mutex_lock(&state->lock);
+  return false;
+}
+
+/**
+ * Finishes target, which connection failed.
+ * Request is retried once, if reused connection fails before response.
+ * Must be called with target lock held.
+ *
+ * @return {@code false} if target state destroyed.
+ */
+static bool handle_target_failure(target_state_t* state) {
+  if (state->reused && !state->response_started && retry_request(state))
+    return true;
+
+  finish_failed_entry(state);
+  target_cleanup(state);
+  return false;
+}
+
+bool target_task_run(void* arg, int events) {
   target_state_t* state = (target_state_t*)arg;
-  int result, events, error;
+  int result, error;
 
-  if (!target_init(state))
-    return NULL;
+  error = pthread_mutex_lock(&state->lock);
+  if (error) {
+    // Client cannot take broken lock too, so target is closed without it
+    proxy_error(error, "Cannot lock target lock");
+    finish_failed_entry(state);
+    close_target(state);
+    free_target(state, false);
+    return false;
+  }
 
-  while (1) {
-    error = pthread_cond_wait(&state->notifier, &state->lock);
-    if (error) {
-      proxy_error(error, "Cannot wait target condition");
-      cache_entry_mark_invalid_and_finished(state->cache);
-      target_cleanup(state);
-      return NULL;
+  if (events & TARGET_FAILURE_EVENT) {
+    finish_unconnected(state);
+    return false;
+  }
+
+  // Only connection attempts are handled, until some of them succeeds
+  if (state->connecting) {
+    result = target_connector_poll(&state->connector);
+    if (result == TARGET_CONNECTOR_PENDING) {
+      pthread_mutex_unlock(&state->lock);
+      return true;
     }
-    events = state->revents;
-
-    // Handle output
-    if (events & POLLOUT) {
-      result = send_pstring(state->socket, &state->outbuff);
-      if (result == -1) {
-        cache_entry_mark_invalid_and_finished(state->cache);
-        target_cleanup(state);
-        return NULL;
-      } else if (result == 0)
-        sockets_cancel_out_handle(state->socket);
+
+    if (result == -1) {
+      proxy_error(state->connector.error, "Cannot connect to %s",
+                  state->host);
+      finish_unconnected(state);
+      return false;
     }
 
-    // Handle input
-    if (events & (POLLIN | POLLPRI)) {
-      result = target_input_handler(state);
-      if (result == -1) {
-        // If parse/receive error, mark invalid and finish
-        cache_entry_mark_invalid_and_finished(state->cache);
-        target_cleanup(state);
-        return NULL;
-      } else if (result == 1 && !state->message_complete) {
-        state->message_complete = true;
-        continue;
-      }
+    if (!attach_connected(state, result)) {
+      finish_unconnected(state);
+      return false;
     }
 
-    // Handle ending
-    if (state->message_complete) {
-      // If not OK code, mark entry as invalid
-      if (state->parser.status_code != 200)
-        cache_entry_mark_invalid_and_finished(state->cache);
-      else
-        cache_entry_mark_finished(state->cache);
+    // Request is sent at once
+    events = POLLOUT;
+  } else if (state->socket == -1) {
+    // Events of retried connection are left, while name is resolved
+    pthread_mutex_unlock(&state->lock);
+    return true;
+  }
+
+  // Handle output
+  if (events & POLLOUT) {
+    // Request is kept to be sent again, until response is started
+    bool replayable = state->reused && !state->response_started;
+    if (replayable && state->outbuff.len > 0 &&
+        !pstring_append(&state->sent, state->outbuff.str,
+                        state->outbuff.len)) {
+      perror("Cannot store sent request");
+      finish_failed_entry(state);
       target_cleanup(state);
-      return NULL;
+      return false;
     }
+
+    result = send_pstring(state->socket, &state->outbuff);
+    if (replayable)
+      state->sent.len -= state->outbuff.len;
+    if (result == -1)
+      return handle_target_failure(state);
+    else if (result == 0)
+      sockets_cancel_out_handle(state->socket);
   }
+
+  // Handle input
+  if (events & (POLLIN | POLLPRI)) {
+    // If parse/receive error, mark invalid and finish
+    if (target_input_handler(state) == -1)
+      return handle_target_failure(state);
+  } else if (events & (POLLHUP | POLLERR))
+    return handle_target_failure(state);
+
+  // Handle ending
+  if (state->message_complete) {
+    // Revalidated or used stale entry replaces entry, not stored is invalid
+    if (state->revalidated)
+      cache_entry_mark_revalidated(state->cache);
+    else if (state->stale_used)
+      cache_entry_mark_stale_used(state->cache);
+    else if (!state->storable)
+      cache_entry_mark_invalid_and_finished(state->cache);
+    else
+      cache_entry_mark_finished(state->cache);
+    target_cleanup(state);
+    return false;
+  }
+
+  pthread_mutex_unlock(&state->lock);
+  sockets_resume_handle(state->socket);
+  return true;
+}
+
+void target_connection_failed(target_state_t* state) {
+  // Target task can still run after request retry
+  worker_pool_submit(&state->task, TARGET_FAILURE_EVENT);
 }
 
 void target_handler(int socket, int events, void* arg) {
   target_state_t* state = (target_state_t*)arg;
 
-  state->revents = events;
-  pthread_cond_signal(&state->notifier);
+  worker_pool_submit(&state->task, events);
+}
+
+void target_attempt_handler(int socket, int events, void* arg) {
+  target_state_t* state = (target_state_t*)arg;
+
+  // Attempt events are not mixed with events of connected socket
+  worker_pool_submit(&state->task, TARGET_ATTEMPT_EVENT);
 }
@@ -1,3 +1,6 @@
+#include <stdbool.h>
+
+#include "proxy-handler.h"
 
 #ifndef _PROXY_TARGET_HANDLER_H
 #define _PROXY_TARGET_HANDLER_H
@@ -8,8 +11,23 @@
 void target_handler(int socket, int events, void* arg);
 
 /**
- * Target thread routine.
+ * Callback for connection attempts to proxying target.
+ */
+void target_attempt_handler(int socket, int events, void* arg);
+
+/**
+ * Handles target socket events in worker thread.
+ *
+ * @return {@code false} if target state destroyed.
+ */
+bool target_task_run(void* arg, int events);
+
+/**
+ * Finishes target, which cannot be connected.
+ * Stale cache entry is used, if it is allowed.
+ *
+ * @param state Target state.
  */
-void* target_thread(void* arg);
+void target_connection_failed(target_state_t* state);
 
 #endif
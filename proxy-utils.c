@@ -1,10 +1,13 @@
 
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
 
 #include "proxy-utils.h"
 
 #define BUFFER_SIZE 4096
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
 
 static void vproxy_error(int err, const char* format, va_list args) {
   char buffer[BUFFER_SIZE + 1];
@@ -32,3 +35,21 @@ void proxy_log(const char* format, ...) {
   va_end(args);
 #endif
 }
+
+long long proxy_current_millis(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint64_t fnv1a_hash(const char* str) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+
+  for (const char* pos = str; *pos != '\0'; pos++) {
+    hash ^= (unsigned char)*pos;
+    hash *= FNV_PRIME;
+  }
+
+  return hash;
+}
@@ -1,4 +1,5 @@
 
+#include <stdint.h>
 #include <stdio.h>
 
 #ifndef _PROXY_UTILS_H
@@ -8,4 +9,14 @@ void proxy_error(int err, const char* format, ...);
 
 void proxy_log(const char* format, ...);
 
+/**
+ * @return Monotonic time in milliseconds.
+ */
+long long proxy_current_millis(void);
+
+/**
+ * @return FNV-1a hash of string.
+ */
+uint64_t fnv1a_hash(const char* str);
+
 #endif
@@ -0,0 +1,419 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "proxy-utils.h"
+
+#include "resolver.h"
+
+#define RESOLVER_BUCKETS_COUNT 256
+// The oldest resolved name is evicted for new one above limit
+#define RESOLVER_CACHE_LIMIT 4096
+#define RESOLVER_NEGATIVE_TTL 5
+
+typedef struct resolver_waiter {
+  resolver_callback_t callback;
+  void* arg;
+  struct resolver_waiter* next;
+} resolver_waiter_t;
+
+typedef struct resolver_record {
+  char* hostname;
+  char* port;
+  resolver_result_t* result;
+  time_t expires;
+  bool pending;
+  bool cached;
+  resolver_waiter_t* waiters;
+  struct resolver_record* next;
+  struct resolver_record* older;
+  struct resolver_record* newer;
+  struct resolver_record* queue_next;
+} resolver_record_t;
+
+typedef struct resolver {
+  pthread_mutex_t lock;
+  pthread_cond_t notifier;
+  resolver_record_t* buckets[RESOLVER_BUCKETS_COUNT];
+  size_t records_count;
+  // Cached records in creation order
+  resolver_record_t* oldest;
+  resolver_record_t* newest;
+  resolver_record_t* queue_head;
+  resolver_record_t* queue_tail;
+  long ttl;
+  pthread_t* threads;
+  size_t threads_count;
+  bool stopping;
+} resolver_t;
+
+static resolver_t resolver;
+
+/**
+ * Selects bucket by FNV-1a hash of name and port.
+ */
+static resolver_record_t** bucket_of(const char* hostname, const char* port) {
+  uint64_t hash = fnv1a_hash(hostname) ^ fnv1a_hash(port);
+
+  return &resolver.buckets[hash % RESOLVER_BUCKETS_COUNT];
+}
+
+void resolver_result_retain(resolver_result_t* result) {
+  __atomic_add_fetch(&result->refs, 1, __ATOMIC_RELAXED);
+}
+
+void resolver_result_release(resolver_result_t* result) {
+  if (result == NULL)
+    return;
+
+  if (__atomic_sub_fetch(&result->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    if (result->addresses != NULL)
+      freeaddrinfo(result->addresses);
+    free(result);
+  }
+}
+
+static void record_free(resolver_record_t* record) {
+  resolver_result_release(record->result);
+  free(record->hostname);
+  free(record->port);
+  free(record);
+}
+
+/**
+ * Removes record unlinked from its bucket from cache and frees it.
+ * Must be called with resolver lock held.
+ */
+static void forget_record(resolver_record_t* record) {
+  if (record->older != NULL)
+    record->older->newer = record->newer;
+  else
+    resolver.oldest = record->newer;
+  if (record->newer != NULL)
+    record->newer->older = record->older;
+  else
+    resolver.newest = record->older;
+
+  resolver.records_count--;
+  record_free(record);
+}
+
+/**
+ * Removes expired records from bucket.
+ * Must be called with resolver lock held.
+ */
+static void remove_expired(resolver_record_t** bucket, time_t now) {
+  resolver_record_t** link = bucket;
+
+  while (*link != NULL) {
+    resolver_record_t* record = *link;
+    if (record->pending || now < record->expires) {
+      link = &record->next;
+      continue;
+    }
+
+    (*link) = record->next;
+    forget_record(record);
+  }
+}
+
+/**
+ * Removes the oldest resolved record from full cache.
+ * Must be called with resolver lock held.
+ *
+ * @return {@code true} if record removed.
+ */
+static bool evict_oldest(void) {
+  resolver_record_t* record = resolver.oldest;
+
+  // Pending records are referenced by resolver threads
+  while (record != NULL && record->pending)
+    record = record->newer;
+  if (record == NULL)
+    return false;
+
+  resolver_record_t** link = bucket_of(record->hostname, record->port);
+  while (*link != record)
+    link = &(*link)->next;
+  (*link) = record->next;
+  forget_record(record);
+
+  return true;
+}
+
+/**
+ * Creates pending record and queues it for resolving.
+ * Record is cached, if cache is not full or the oldest record
+ * can be evicted.
+ * Must be called with resolver lock held.
+ *
+ * @return Created record or {@code NULL}.
+ */
+static resolver_record_t* create_record(resolver_record_t** bucket,
+                                        const char* hostname,
+                                        const char* port) {
+  resolver_record_t* record =
+      (resolver_record_t*)calloc(1, sizeof(resolver_record_t));
+  if (record == NULL)
+    return NULL;
+
+  record->hostname = strdup(hostname);
+  record->port = strdup(port);
+  if (record->hostname == NULL || record->port == NULL) {
+    record_free(record);
+    return NULL;
+  }
+  record->pending = true;
+
+  if (resolver.records_count < RESOLVER_CACHE_LIMIT || evict_oldest()) {
+    record->cached = true;
+    record->next = *bucket;
+    (*bucket) = record;
+    record->older = resolver.newest;
+    if (resolver.newest != NULL)
+      resolver.newest->newer = record;
+    else
+      resolver.oldest = record;
+    resolver.newest = record;
+    resolver.records_count++;
+  }
+
+  if (resolver.queue_tail != NULL)
+    resolver.queue_tail->queue_next = record;
+  else
+    resolver.queue_head = record;
+  resolver.queue_tail = record;
+  pthread_cond_signal(&resolver.notifier);
+
+  return record;
+}
+
+int resolver_resolve(const char* hostname,
+                     const char* port,
+                     resolver_result_t** result,
+                     resolver_callback_t callback,
+                     void* arg) {
+  resolver_record_t* record;
+  time_t now = time(NULL);
+  int error;
+
+  resolver_waiter_t* waiter =
+      (resolver_waiter_t*)malloc(sizeof(resolver_waiter_t));
+  if (waiter == NULL) {
+    perror("Cannot allocate resolver waiter");
+    return -1;
+  }
+  waiter->callback = callback;
+  waiter->arg = arg;
+
+  error = pthread_mutex_lock(&resolver.lock);
+  if (error) {
+    proxy_error(error, "Cannot lock resolver");
+    free(waiter);
+    return -1;
+  }
+
+  // Stopped threads never call callback
+  if (resolver.stopping) {
+    pthread_mutex_unlock(&resolver.lock);
+    free(waiter);
+    return -1;
+  }
+
+  resolver_record_t** bucket = bucket_of(hostname, port);
+  remove_expired(bucket, now);
+
+  record = *bucket;
+  while (record != NULL &&
+         (strcmp(record->hostname, hostname) || strcmp(record->port, port)))
+    record = record->next;
+
+  if (record != NULL && !record->pending) {
+    __atomic_add_fetch(&record->result->refs, 1, __ATOMIC_RELAXED);
+    (*result) = record->result;
+    pthread_mutex_unlock(&resolver.lock);
+    free(waiter);
+    return 0;
+  }
+
+  if (record == NULL && (record = create_record(bucket, hostname, port)) ==
+                            NULL) {
+    pthread_mutex_unlock(&resolver.lock);
+    perror("Cannot create resolver record");
+    free(waiter);
+    return -1;
+  }
+
+  waiter->next = record->waiters;
+  record->waiters = waiter;
+
+  pthread_mutex_unlock(&resolver.lock);
+  return 1;
+}
+
+/**
+ * Resolves name of record.
+ *
+ * @return Resolver result referenced by record or {@code NULL}.
+ */
+static resolver_result_t* resolve_record(resolver_record_t* record) {
+  struct addrinfo hints;
+
+  resolver_result_t* result =
+      (resolver_result_t*)calloc(1, sizeof(resolver_result_t));
+  if (result == NULL) {
+    perror("Cannot allocate resolver result");
+    return NULL;
+  }
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = PF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  result->error =
+      getaddrinfo(record->hostname, record->port, &hints, &result->addresses);
+  if (result->error)
+    result->addresses = NULL;
+  result->refs = 1;
+
+  return result;
+}
+
+/**
+ * @return {@code true} if resolving error can be cached.
+ */
+static bool error_permanent(int error) {
+  return error != EAI_AGAIN && error != EAI_MEMORY && error != EAI_SYSTEM;
+}
+
+static void* resolver_thread(void* arg) {
+  resolver_record_t* record;
+  resolver_waiter_t* waiter;
+
+  while (true) {
+    pthread_mutex_lock(&resolver.lock);
+    while (resolver.queue_head == NULL && !resolver.stopping)
+      pthread_cond_wait(&resolver.notifier, &resolver.lock);
+
+    // Queued records are failed by resolver freeing
+    if (resolver.stopping) {
+      pthread_mutex_unlock(&resolver.lock);
+      break;
+    }
+
+    record = resolver.queue_head;
+    resolver.queue_head = record->queue_next;
+    if (resolver.queue_head == NULL)
+      resolver.queue_tail = NULL;
+    pthread_mutex_unlock(&resolver.lock);
+
+    // Name servers are asked without lock, so slow ones block this thread only
+    resolver_result_t* result = resolve_record(record);
+
+    pthread_mutex_lock(&resolver.lock);
+    record->result = result;
+    record->pending = false;
+    if (result == NULL || !error_permanent(result->error))
+      record->expires = 0;
+    else
+      record->expires =
+          time(NULL) + (result->error ? RESOLVER_NEGATIVE_TTL : resolver.ttl);
+    waiter = record->waiters;
+    record->waiters = NULL;
+
+    // Records left out of cache are owned by thread
+    if (result != NULL)
+      __atomic_add_fetch(&result->refs, 1, __ATOMIC_RELAXED);
+    bool owned = !record->cached;
+    pthread_mutex_unlock(&resolver.lock);
+
+    while (waiter != NULL) {
+      resolver_waiter_t* next = waiter->next;
+      if (result != NULL)
+        __atomic_add_fetch(&result->refs, 1, __ATOMIC_RELAXED);
+      waiter->callback(result, waiter->arg);
+      free(waiter);
+      waiter = next;
+    }
+
+    resolver_result_release(result);
+    if (owned)
+      record_free(record);
+  }
+
+  return NULL;
+}
+
+int resolver_init(size_t threads, long ttl) {
+  int error;
+
+  memset(&resolver, 0, sizeof(resolver_t));
+  resolver.ttl = ttl;
+
+  if ((error = pthread_mutex_init(&resolver.lock, NULL)) != 0)
+    return error;
+  if ((error = pthread_cond_init(&resolver.notifier, NULL)) != 0)
+    return error;
+
+  resolver.threads = (pthread_t*)malloc(threads * sizeof(pthread_t));
+  if (resolver.threads == NULL)
+    return errno;
+
+  for (size_t i = 0; i < threads; i++) {
+    error = pthread_create(&resolver.threads[i], NULL, &resolver_thread, NULL);
+    if (error) {
+      proxy_error(error, "Cannot create resolver thread");
+      if (i == 0)
+        return error;
+      break;
+    }
+    resolver.threads_count++;
+  }
+
+  return 0;
+}
+
+void resolver_free(void) {
+  resolver_record_t* record;
+  int error;
+
+  pthread_mutex_lock(&resolver.lock);
+  resolver.stopping = true;
+  pthread_cond_broadcast(&resolver.notifier);
+  pthread_mutex_unlock(&resolver.lock);
+
+  // Names resolved meanwhile are delivered to their waiters
+  for (size_t i = 0; i < resolver.threads_count; i++) {
+    error = pthread_join(resolver.threads[i], NULL);
+    if (error)
+      proxy_error(error, "Cannot join resolver thread");
+  }
+  free(resolver.threads);
+
+  while ((record = resolver.queue_head) != NULL) {
+    resolver.queue_head = record->queue_next;
+
+    while (record->waiters != NULL) {
+      resolver_waiter_t* waiter = record->waiters;
+      record->waiters = waiter->next;
+      waiter->callback(NULL, waiter->arg);
+      free(waiter);
+    }
+
+    // Cached records are freed with the rest of cache
+    if (!record->cached)
+      record_free(record);
+  }
+  resolver.queue_tail = NULL;
+
+  while (resolver.oldest != NULL)
+    forget_record(resolver.oldest);
+  memset(resolver.buckets, 0, sizeof(resolver.buckets));
+
+  pthread_cond_destroy(&resolver.notifier);
+  pthread_mutex_destroy(&resolver.lock);
+}
@@ -0,0 +1,77 @@
+#include <netdb.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef _RESOLVER_H
+#define _RESOLVER_H
+
+typedef struct resolver_result {
+  int refs;
+  int error;
+  struct addrinfo* addresses;
+} resolver_result_t;
+
+/**
+ * Receives resolved target addresses.
+ * Result is referenced by callback and must be released,
+ * it is {@code NULL} if there is not enough memory or resolver
+ * is stopped.
+ */
+typedef void (*resolver_callback_t)(resolver_result_t* result, void* arg);
+
+/**
+ * Starts resolver threads.
+ * Resolved addresses are cached for required time, failures are cached
+ * for a few seconds, so repeated requests to missing host do not
+ * reach name servers.
+ *
+ * @param threads Amount of resolver threads.
+ * @param ttl Seconds, while resolved addresses are used.
+ *
+ * @return {@code 0} if success or error code.
+ */
+int resolver_init(size_t threads, long ttl);
+
+/**
+ * Resolves target stream socket addresses.
+ * Cached result is returned at once, otherwise name is resolved by
+ * resolver thread, which calls callback. Concurrent requests of the
+ * same name wait for single resolution.
+ *
+ * @param hostname Target name or address.
+ * @param port Target port or service name.
+ * @param result Cached result referenced by caller.
+ * @param callback Function called with resolved result.
+ * @param arg Argument for callback.
+ *
+ * @return {@code 0} if cached result returned, {@code 1} if callback
+ * will be called and {@code -1} if error occured or resolver is stopped.
+ */
+int resolver_resolve(const char* hostname,
+                     const char* port,
+                     resolver_result_t** result,
+                     resolver_callback_t callback,
+                     void* arg);
+
+/**
+ * Adds one more reference to resolver result.
+ *
+ * @param result Target result.
+ */
+void resolver_result_retain(resolver_result_t* result);
+
+/**
+ * Releases resolver result.
+ *
+ * @param result Target result or {@code NULL}.
+ */
+void resolver_result_release(resolver_result_t* result);
+
+/**
+ * Stops resolver threads and frees cached results.
+ * Names being resolved are delivered to their callbacks, queued ones
+ * are failed, so callbacks are not called after that.
+ */
+void resolver_free(void);
+
+#endif
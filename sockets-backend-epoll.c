@@ -0,0 +1,200 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/poll.h>
+#include <unistd.h>
+
+#include "sockets-backend.h"
+
+#define EVENTS_BATCH_SIZE 256
+// Sockets data always has socket number in low half
+#define WAKEUP_EVENT_DATA UINT64_MAX
+
+struct sockets_backend {
+  int epoll_fd;
+  int wakeup_fd;
+};
+
+/**
+ * Converts slot poll events mask to epoll events mask.
+ */
+static uint32_t to_epoll_events(socket_slot_t* slot) {
+  uint32_t result = 0;
+  int events = slot->events;
+
+  if (events & POLLIN)
+    result |= EPOLLIN;
+  if (events & POLLPRI)
+    result |= EPOLLPRI;
+  if (events & POLLOUT)
+    result |= EPOLLOUT;
+
+  // Slot is suspended after each reported event, except server sockets
+  if (slot->callback != NULL)
+    result |= EPOLLONESHOT;
+
+  return result;
+}
+
+/**
+ * Converts epoll events mask to poll events mask.
+ */
+static int from_epoll_events(uint32_t events) {
+  int result = 0;
+
+  if (events & EPOLLIN)
+    result |= POLLIN;
+  if (events & EPOLLPRI)
+    result |= POLLPRI;
+  if (events & EPOLLOUT)
+    result |= POLLOUT;
+  if (events & EPOLLERR)
+    result |= POLLERR;
+  if (events & EPOLLHUP)
+    result |= POLLHUP;
+
+  return result;
+}
+
+int sockets_backend_init(sockets_backend_t** result) {
+  int error;
+
+  sockets_backend_t* backend =
+      (sockets_backend_t*)malloc(sizeof(sockets_backend_t));
+  if (backend == NULL)
+    return errno;
+
+  backend->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (backend->epoll_fd == -1) {
+    error = errno;
+    free(backend);
+    return error;
+  }
+
+  backend->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (backend->wakeup_fd == -1) {
+    error = errno;
+    goto error_wakeup;
+  }
+
+  struct epoll_event event = {EPOLLIN, {.u64 = WAKEUP_EVENT_DATA}};
+  if (epoll_ctl(backend->epoll_fd, EPOLL_CTL_ADD, backend->wakeup_fd,
+                &event)) {
+    error = errno;
+    close(backend->wakeup_fd);
+    goto error_wakeup;
+  }
+
+  (*result) = backend;
+  return 0;
+
+error_wakeup:
+  close(backend->epoll_fd);
+  free(backend);
+  return error;
+}
+
+void sockets_backend_destroy(sockets_backend_t* backend) {
+  close(backend->wakeup_fd);
+  close(backend->epoll_fd);
+  free(backend);
+}
+
+/**
+ * Packs socket and its slot generation to epoll event data.
+ */
+static uint64_t pack_event_data(socket_slot_t* slot) {
+  return ((uint64_t)slot->generation << 32) | (uint32_t)slot->socket;
+}
+
+bool sockets_backend_add(sockets_backend_t* backend, socket_slot_t* slot) {
+  struct epoll_event event;
+
+  event.events = to_epoll_events(slot);
+  event.data.u64 = pack_event_data(slot);
+  if (epoll_ctl(backend->epoll_fd, EPOLL_CTL_ADD, slot->socket, &event)) {
+    perror("Cannot add socket to epoll");
+    return false;
+  }
+
+  return true;
+}
+
+bool sockets_backend_modify(sockets_backend_t* backend, socket_slot_t* slot) {
+  struct epoll_event event;
+
+  event.events = to_epoll_events(slot);
+  event.data.u64 = pack_event_data(slot);
+  if (epoll_ctl(backend->epoll_fd, EPOLL_CTL_MOD, slot->socket, &event)) {
+    perror("Cannot modify socket in epoll");
+    return false;
+  }
+
+  return true;
+}
+
+void sockets_backend_suspend(sockets_backend_t* backend, socket_slot_t* slot) {
+  // Already disabled by EPOLLONESHOT
+}
+
+void sockets_backend_remove(sockets_backend_t* backend, socket_slot_t* slot) {
+  // Event argument ignored, but required by kernels before 2.6.9
+  struct epoll_event event = {0};
+
+  epoll_ctl(backend->epoll_fd, EPOLL_CTL_DEL, slot->socket, &event);
+}
+
+bool sockets_backend_released(sockets_backend_t* backend, socket_slot_t* slot) {
+  return true;
+}
+
+bool sockets_backend_wakeup(sockets_backend_t* backend) {
+  uint64_t value = 1;
+
+  if (write(backend->wakeup_fd, &value, sizeof(value)) < 0) {
+    perror("Cannot wakeup sockets loop");
+    return false;
+  }
+
+  return true;
+}
+
+int sockets_backend_wait(sockets_backend_t* backend,
+                         sockets_event_t* events,
+                         int max,
+                         int timeout) {
+  struct epoll_event ready[EVENTS_BATCH_SIZE];
+  uint64_t value;
+  int count, result = 0;
+
+  if (max > EVENTS_BATCH_SIZE)
+    max = EVENTS_BATCH_SIZE;
+
+  count = epoll_wait(backend->epoll_fd, ready, max, timeout);
+  if (count == -1)
+    return -1;
+
+  for (int i = 0; i < count; i++) {
+    // Wakeup counter is only drained, it is level triggered
+    if (ready[i].data.u64 == WAKEUP_EVENT_DATA) {
+      while (read(backend->wakeup_fd, &value, sizeof(value)) > 0)
+        ;
+      continue;
+    }
+
+    events[result].socket = (int)(uint32_t)ready[i].data.u64;
+    events[result].generation = (unsigned int)(ready[i].data.u64 >> 32);
+    events[result].revents = from_epoll_events(ready[i].events);
+    result++;
+  }
+
+  return result;
+}
+
+bool sockets_backend_commit(sockets_backend_t* backend) {
+  // Epoll interest list is updated in place
+  return true;
+}
@@ -0,0 +1,329 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "sockets-backend.h"
+
+#define POLL_PRE_SIZE 50
+#define POLL_GROW_SPEED 2
+#define BUFFER_SIZE 128
+// Position zero is taken by wakeup descriptor
+#define NOT_POLLED 0
+
+struct sockets_backend {
+  int wakeup_fd[2];
+  bool wakeup_pending;
+  size_t changes_count;
+  size_t changes_size;
+  socket_slot_t** changes;
+  size_t polls_count;
+  size_t size;
+  struct pollfd* polls;
+  unsigned int* generations;
+  socket_slot_t** slots;
+};
+
+/**
+ * Opens descriptor for poll loop wakeups.
+ * Uses eventfd if available, otherwise pipe.
+ *
+ * @return {@code true} if success.
+ */
+static bool open_wakeup_fd(sockets_backend_t* backend) {
+#ifdef __linux__
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd == -1) {
+    perror("Cannot create wakeup eventfd");
+    return false;
+  }
+  backend->wakeup_fd[0] = backend->wakeup_fd[1] = fd;
+#else
+  if (pipe(backend->wakeup_fd)) {
+    perror("Cannot create wakeup pipe");
+    return false;
+  }
+  fcntl(backend->wakeup_fd[0], F_SETFL, O_NONBLOCK);
+#endif
+  return true;
+}
+
+/**
+ * Closes descriptor for poll loop wakeups.
+ */
+static void close_wakeup_fd(sockets_backend_t* backend) {
+  close(backend->wakeup_fd[0]);
+  if (backend->wakeup_fd[1] != backend->wakeup_fd[0])
+    close(backend->wakeup_fd[1]);
+}
+
+int sockets_backend_init(sockets_backend_t** result) {
+  int error;
+
+  sockets_backend_t* backend =
+      (sockets_backend_t*)malloc(sizeof(sockets_backend_t));
+  if (backend == NULL)
+    return errno;
+
+  if (!open_wakeup_fd(backend)) {
+    error = errno;
+    free(backend);
+    return error;
+  }
+  backend->wakeup_pending = false;
+
+  backend->size = backend->changes_size = POLL_PRE_SIZE;
+  backend->changes_count = 0;
+
+  backend->changes =
+      (socket_slot_t**)calloc(backend->changes_size, sizeof(socket_slot_t*));
+  if (backend->changes == NULL)
+    goto error_changes;
+
+  backend->polls = (struct pollfd*)calloc(backend->size, sizeof(struct pollfd));
+  if (backend->polls == NULL)
+    goto error_polls;
+
+  backend->generations =
+      (unsigned int*)calloc(backend->size, sizeof(unsigned int));
+  if (backend->generations == NULL)
+    goto error_generations;
+
+  backend->slots =
+      (socket_slot_t**)calloc(backend->size, sizeof(socket_slot_t*));
+  if (backend->slots == NULL)
+    goto error_slots;
+
+  // Wakeup descriptor is always first
+  backend->polls_count = 1;
+  backend->polls[0].fd = backend->wakeup_fd[0];
+  backend->polls[0].events = POLLIN | POLLPRI;
+
+  (*result) = backend;
+  return 0;
+
+error_slots:
+  free(backend->generations);
+error_generations:
+  free(backend->polls);
+error_polls:
+  free(backend->changes);
+error_changes:
+  error = errno;
+  close_wakeup_fd(backend);
+  free(backend);
+  return error;
+}
+
+void sockets_backend_destroy(sockets_backend_t* backend) {
+  close_wakeup_fd(backend);
+  free(backend->changes);
+  free(backend->polls);
+  free(backend->generations);
+  free(backend->slots);
+  free(backend);
+}
+
+/**
+ * Records slot change, which will be applied by poll loop.
+ *
+ * @param slot Changed slot.
+ *
+ * @return {@code true} if success.
+ */
+static bool queue_change(sockets_backend_t* backend, socket_slot_t* slot) {
+  if (slot->backend_queued)
+    return true;
+
+  if (backend->changes_count >= backend->changes_size) {
+    size_t size = backend->changes_size * POLL_GROW_SPEED;
+    socket_slot_t** temp = (socket_slot_t**)realloc(
+        backend->changes, size * sizeof(socket_slot_t*));
+    if (temp == NULL) {
+      perror("Cannot increase sockets changes size");
+      return false;
+    }
+    backend->changes = temp;
+    backend->changes_size = size;
+  }
+
+  backend->changes[backend->changes_count++] = slot;
+  slot->backend_queued = true;
+  return true;
+}
+
+/**
+ * Wakes up poll loop to apply changes.
+ * All changes until next commit are coalesced into one wakeup.
+ */
+static bool notify_loop(sockets_backend_t* backend) {
+  uint64_t value = 1;
+
+  if (__atomic_exchange_n(&backend->wakeup_pending, true, __ATOMIC_ACQ_REL))
+    return true;
+
+  if (write(backend->wakeup_fd[1], &value, sizeof(value)) < 0) {
+    perror("Cannot wakeup sockets loop");
+    return false;
+  }
+
+  return true;
+}
+
+bool sockets_backend_add(sockets_backend_t* backend, socket_slot_t* slot) {
+  if (!queue_change(backend, slot))
+    return false;
+
+  // Do not notify about new socket without events
+  if (slot->events == 0)
+    return true;
+
+  return notify_loop(backend);
+}
+
+bool sockets_backend_modify(sockets_backend_t* backend, socket_slot_t* slot) {
+  return queue_change(backend, slot) && notify_loop(backend);
+}
+
+void sockets_backend_suspend(sockets_backend_t* backend, socket_slot_t* slot) {
+  // Applied by commit after events dispatching without wakeup
+  queue_change(backend, slot);
+}
+
+void sockets_backend_remove(sockets_backend_t* backend, socket_slot_t* slot) {
+  // Pre notify for closing sockets
+  if (queue_change(backend, slot))
+    notify_loop(backend);
+}
+
+bool sockets_backend_released(sockets_backend_t* backend, socket_slot_t* slot) {
+  return !slot->backend_queued && slot->backend_pos == NOT_POLLED;
+}
+
+bool sockets_backend_wakeup(sockets_backend_t* backend) {
+  return notify_loop(backend);
+}
+
+int sockets_backend_wait(sockets_backend_t* backend,
+                         sockets_event_t* events,
+                         int max,
+                         int timeout) {
+  char buffer[BUFFER_SIZE];
+  int count, result = 0;
+
+  count = poll(backend->polls, (nfds_t)backend->polls_count, timeout);
+  if (count == -1)
+    return -1;
+
+  // Drain wakeup descriptor
+  if (backend->polls[0].revents) {
+    if (!(backend->polls[0].revents & (POLLIN | POLLPRI))) {
+      fprintf(stderr, "Cannot handle wakeup descriptor\n");
+      errno = EPIPE;
+      return -1;
+    }
+    while (read(backend->wakeup_fd[0], buffer, BUFFER_SIZE) > 0)
+      ;
+    backend->polls[0].revents = 0;
+    count--;
+  }
+
+  for (size_t i = 1; i < backend->polls_count && count > 0; i++) {
+    if (backend->polls[i].revents == 0)
+      continue;
+    count--;
+
+    // Rest events will be reported on the next iteration
+    if (result < max) {
+      events[result].socket = backend->polls[i].fd;
+      events[result].generation = backend->generations[i];
+      events[result].revents = backend->polls[i].revents;
+      result++;
+    }
+    backend->polls[i].revents = 0;
+  }
+
+  return result;
+}
+
+/**
+ * Appends slot to the polled set.
+ */
+static bool append_polled(sockets_backend_t* backend, socket_slot_t* slot) {
+  if (backend->polls_count >= backend->size) {
+    size_t size = backend->size * POLL_GROW_SPEED;
+    struct pollfd* temp_polls =
+        (struct pollfd*)realloc(backend->polls, sizeof(struct pollfd) * size);
+    if (temp_polls == NULL)
+      return false;
+    backend->polls = temp_polls;
+
+    unsigned int* temp_generations = (unsigned int*)realloc(
+        backend->generations, sizeof(unsigned int) * size);
+    if (temp_generations == NULL)
+      return false;
+    backend->generations = temp_generations;
+
+    socket_slot_t** temp_slots =
+        (socket_slot_t**)realloc(backend->slots, sizeof(socket_slot_t*) * size);
+    if (temp_slots == NULL)
+      return false;
+    backend->slots = temp_slots;
+
+    backend->size = size;
+  }
+
+  slot->backend_pos = backend->polls_count++;
+  backend->slots[slot->backend_pos] = slot;
+  return true;
+}
+
+/**
+ * Removes slot from the polled set.
+ */
+static void remove_polled(sockets_backend_t* backend, socket_slot_t* slot) {
+  size_t pos = slot->backend_pos;
+  size_t last = --backend->polls_count;
+
+  backend->polls[pos] = backend->polls[last];
+  backend->generations[pos] = backend->generations[last];
+  backend->slots[pos] = backend->slots[last];
+  backend->slots[pos]->backend_pos = pos;
+  slot->backend_pos = NOT_POLLED;
+}
+
+bool sockets_backend_commit(sockets_backend_t* backend) {
+  // Changes queued after this point require new wakeup
+  __atomic_store_n(&backend->wakeup_pending, false, __ATOMIC_RELEASE);
+
+  for (size_t i = 0; i < backend->changes_count; i++) {
+    socket_slot_t* slot = backend->changes[i];
+    slot->backend_queued = false;
+
+    if (!slot->used) {
+      if (slot->backend_pos != NOT_POLLED)
+        remove_polled(backend, slot);
+      continue;
+    }
+
+    if (slot->backend_pos == NOT_POLLED && !append_polled(backend, slot))
+      return false;
+
+    // Hang up is reported even without events, so suspended is not polled
+    backend->polls[slot->backend_pos].fd =
+        slot->suspended ? -1 : slot->socket;
+    backend->polls[slot->backend_pos].events = (short)slot->events;
+    backend->polls[slot->backend_pos].revents = 0;
+    backend->generations[slot->backend_pos] = slot->generation;
+  }
+  backend->changes_count = 0;
+
+  return true;
+}
@@ -0,0 +1,138 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef _SOCKETS_BACKEND_H
+#define _SOCKETS_BACKEND_H
+
+struct sockets_reactor;
+
+typedef struct sockets_backend sockets_backend_t;
+
+typedef struct socket_slot {
+  int socket;
+  unsigned int generation;
+  bool used;
+  struct sockets_reactor* reactor;
+  int events;
+  bool suspended;
+  void (*callback)(int, int, void*);
+  void* arg;
+  size_t backend_pos;
+  bool backend_queued;
+  long long deadline;
+  // Position in reactor timers heap plus one, zero if there is no timer
+  size_t timer_pos;
+} socket_slot_t;
+
+typedef struct sockets_event {
+  int socket;
+  unsigned int generation;
+  int revents;
+} sockets_event_t;
+
+/**
+ * Creates readiness notification backend.
+ *
+ * @param backend Created backend.
+ *
+ * @return {@code 0} if success or error code.
+ */
+int sockets_backend_init(sockets_backend_t** backend);
+
+/**
+ * Destroys readiness notification backend.
+ *
+ * @param backend Target backend.
+ */
+void sockets_backend_destroy(sockets_backend_t* backend);
+
+/**
+ * Starts watching for socket slot events.
+ * Must be called with reactor lock held.
+ *
+ * @param backend Target backend.
+ * @param slot Registered slot.
+ *
+ * @return {@code true} if success.
+ */
+bool sockets_backend_add(sockets_backend_t* backend, socket_slot_t* slot);
+
+/**
+ * Applies changed slot events mask.
+ * Must be called with reactor lock held.
+ *
+ * @param backend Target backend.
+ * @param slot Registered slot.
+ *
+ * @return {@code true} if success.
+ */
+bool sockets_backend_modify(sockets_backend_t* backend, socket_slot_t* slot);
+
+/**
+ * Stops reporting slot events until next modification.
+ * Called for each slot with reported events.
+ * Must be called with reactor lock held.
+ *
+ * @param backend Target backend.
+ * @param slot Registered slot.
+ */
+void sockets_backend_suspend(sockets_backend_t* backend, socket_slot_t* slot);
+
+/**
+ * Stops watching for socket slot events.
+ * Must be called with reactor lock held and before socket closing.
+ *
+ * @param backend Target backend.
+ * @param slot Registered slot.
+ */
+void sockets_backend_remove(sockets_backend_t* backend, socket_slot_t* slot);
+
+/**
+ * Checks that removed slot is not referenced by backend anymore,
+ * so it can be registered in other backend.
+ * Must be called with reactor lock held.
+ *
+ * @param backend Target backend.
+ * @param slot Removed slot.
+ *
+ * @return {@code true} if slot released.
+ */
+bool sockets_backend_released(sockets_backend_t* backend, socket_slot_t* slot);
+
+/**
+ * Waits for ready sockets.
+ * Must be called without reactor lock.
+ *
+ * @param backend Target backend.
+ * @param events Output events buffer.
+ * @param max Output events buffer length.
+ * @param timeout Maximum waiting time in milliseconds or {@code -1}.
+ *
+ * @return Amount of ready sockets or {@code -1} and sets errno.
+ */
+int sockets_backend_wait(sockets_backend_t* backend,
+                         sockets_event_t* events,
+                         int max,
+                         int timeout);
+
+/**
+ * Interrupts current or next waiting, so reactor can recompute
+ * its waiting timeout.
+ *
+ * @param backend Target backend.
+ *
+ * @return {@code true} if success.
+ */
+bool sockets_backend_wakeup(sockets_backend_t* backend);
+
+/**
+ * Called by reactor loop after events dispatching.
+ * Must be called with reactor lock held.
+ *
+ * @param backend Target backend.
+ *
+ * @return {@code true} if success.
+ */
+bool sockets_backend_commit(sockets_backend_t* backend);
+
+#endif
@@ -1,513 +1,835 @@
-
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/poll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #include "proxy-handler.h"
 #include "proxy-utils.h"
+#include "sockets-backend.h"
 #include "sockets-handler.h"
 
-#define POLL_PRE_SIZE 50
-#define POLL_GROW_SPEED 2
-#define BUFFER_SIZE 128
+#define SLOTS_CHUNK_SIZE 1024
+#define SLOTS_DEFAULT_LIMIT 65536
+#define EVENTS_BATCH_SIZE 256
+#define LISTEN_BACKLOG 50
+#define ACCEPT_BATCH_SIZE 64
+#define TIMERS_PRE_SIZE 64
+#define TIMERS_GROW_SPEED 2
 
-typedef struct callback {
-  void (*callback)(int, int, void*);
-  void* arg;
-} callback_t;
+typedef struct sockets_reactor {
+  pthread_mutex_t lock;
+  pthread_t thread;
+  int server_socket;
+  socket_slot_t server;
+  sockets_backend_t* backend;
+  // Min-heap of slots by deadline, slots keep their positions
+  socket_slot_t** timers;
+  size_t timers_count;
+  size_t timers_size;
+} sockets_reactor_t;
 
 typedef struct sockets_state {
-  int signal_pipe;
-  pthread_mutex_t lock;
-  size_t polls_count;
-  size_t size;
-  struct pollfd* polls;
-  callback_t* callbacks;
-  bool changed;
-  size_t _polls_count_copy;
-  size_t _size_copy;
-  struct pollfd* _polls_copy;
-  callback_t* _callbacks_copy;
+  // Original server socket, which can be shared by reactors
+  int server_socket;
+  size_t reactors_count;
+  sockets_reactor_t* reactors;
+  size_t next_reactor;
+  size_t chunks_count;
+  socket_slot_t** chunks;
+  volatile bool stopping;
+  // Reactors are stopped, since some of them cannot work anymore
+  volatile bool server_failed;
+  volatile bool reactor_failed;
 } sockets_state_t;
 
 /**
- * Removes socket at required position.
+ * Global sockets state.
  */
-static void remove_socket_at(size_t);
+static sockets_state_t state;
 
 /**
- * Global sockets state.
+ * Reactor running in current thread.
  */
-static sockets_state_t state;
+static __thread sockets_reactor_t* current_reactor;
 
-void sockets_destroy() {
-  while (state.polls_count-- > 1) {
-    callback_t* cb = &state.callbacks[state.polls_count];
-    if (cb->callback == NULL)  // For server socket or signal pipe
-      close(state.polls[state.polls_count].fd);
-    else
-      cb->callback(state.polls[state.polls_count].fd, POLLHUP, cb->arg);
+/**
+ * Provides slot for required socket.
+ * Slots are direct-mapped by socket number.
+ *
+ * @param socket Required socket.
+ * @param create Allocate slots chunk if it not exists.
+ *
+ * @return Socket slot or {@code NULL}.
+ */
+static socket_slot_t* slot_at(int socket, bool create) {
+  size_t index = (size_t)socket / SLOTS_CHUNK_SIZE;
+  socket_slot_t* chunk;
+  socket_slot_t* expected = NULL;
+
+  if (socket < 0 || index >= state.chunks_count)
+    return NULL;
+
+  chunk = __atomic_load_n(&state.chunks[index], __ATOMIC_ACQUIRE);
+  if (chunk != NULL || !create)
+    return chunk == NULL ? NULL : &chunk[socket % SLOTS_CHUNK_SIZE];
+
+  chunk = (socket_slot_t*)calloc(SLOTS_CHUNK_SIZE, sizeof(socket_slot_t));
+  if (chunk == NULL) {
+    perror("Cannot allocate sockets slots");
+    return NULL;
   }
 
-  while (state._polls_count_copy-- > 1) {
-    callback_t* cb = &state._callbacks_copy[state._polls_count_copy];
-    if (cb->callback == NULL)  // For server socket or signal pipe
-      close(state._polls_copy[state._polls_count_copy].fd);
-    else
-      cb->callback(state._polls_copy[state._polls_count_copy].fd, POLLHUP,
-                   cb->arg);
+  // Other reactor can allocate the same chunk concurrently
+  if (!__atomic_compare_exchange_n(&state.chunks[index], &expected, chunk,
+                                   false, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_ACQUIRE)) {
+    free(chunk);
+    chunk = expected;
   }
 
-  close(state.signal_pipe);
-  free(state.polls);
-  free(state._polls_copy);
-  free(state.callbacks);
-  free(state._callbacks_copy);
+  return &chunk[socket % SLOTS_CHUNK_SIZE];
 }
 
 /**
- * Initializes socket processing.
+ * Looking for a slot of registered socket and locks its reactor.
  *
- * @param server_socket Socket for receiving new clients.
+ * @param socket Required socket.
+ * @param result Found slot.
+ *
+ * @return Locked reactor of the socket or {@code NULL}.
  */
-static int init_sockets_state(int server_socket) {
+static sockets_reactor_t* lock_slot(int socket, socket_slot_t** result) {
+  sockets_reactor_t* reactor;
+  socket_slot_t* slot = slot_at(socket, false);
   int error;
-  int pipes[2];
 
-  if (pipe(pipes)) {
-    perror("Cannot create signal pipe");
-    return errno;
+  if (slot == NULL)
+    return NULL;
+
+  while ((reactor = __atomic_load_n(&slot->reactor, __ATOMIC_ACQUIRE))) {
+    error = pthread_mutex_lock(&reactor->lock);
+    if (error) {
+      proxy_error(error, "Cannot lock sockets reactor");
+      return NULL;
+    }
+
+    // Socket can be moved to other reactor before lock
+    if (slot->reactor == reactor) {
+      if (!slot->used)
+        break;
+      (*result) = slot;
+      return reactor;
+    }
+
+    pthread_mutex_unlock(&reactor->lock);
   }
-  state.signal_pipe = pipes[1];
 
-  state.size = state._size_copy = POLL_PRE_SIZE;
-  state.changed = false;
+  if (reactor != NULL)
+    pthread_mutex_unlock(&reactor->lock);
+  return NULL;
+}
+
+void sockets_hangup() {
+  for (size_t i = 0; i < state.chunks_count; i++) {
+    socket_slot_t* chunk = state.chunks[i];
+    if (chunk == NULL)
+      continue;
 
-  state.polls = (struct pollfd*)malloc(sizeof(struct pollfd) * state.size);
-  if (state.polls == NULL)
-    return errno;
-  state.callbacks = (callback_t*)malloc(sizeof(callback_t) * state.size);
-  if (state.callbacks == NULL) {
-    error = errno;
-    free(state.polls);
-    return error;
+    for (size_t j = 0; j < SLOTS_CHUNK_SIZE; j++) {
+      socket_slot_t* slot = &chunk[j];
+      if (slot->used)
+        slot->callback(slot->socket, POLLHUP, slot->arg);
+    }
   }
-  memset(state.polls, 0, sizeof(struct pollfd) * state.size);
-  memset(state.callbacks, 0, sizeof(callback_t) * state.size);
-
-  state._polls_copy =
-      (struct pollfd*)malloc(sizeof(struct pollfd) * state.size);
-  if (state._polls_copy == NULL) {
-    error = errno;
-    free(state.callbacks);
-    free(state.polls);
-    return error;
+}
+
+void sockets_destroy() {
+  for (size_t i = 0; i < state.reactors_count; i++) {
+    sockets_reactor_t* reactor = &state.reactors[i];
+    if (reactor->server_socket != -1 &&
+        reactor->server_socket != state.server_socket)
+      close(reactor->server_socket);
+    sockets_backend_destroy(reactor->backend);
+    free(reactor->timers);
   }
-  state._callbacks_copy = (callback_t*)malloc(sizeof(callback_t) * state.size);
-  if (state._callbacks_copy == NULL) {
-    error = errno;
-    free(state._polls_copy);
-    free(state.callbacks);
-    free(state.polls);
-    return error;
+  close(state.server_socket);
+
+  for (size_t i = 0; i < state.chunks_count; i++)
+    free(state.chunks[i]);
+  free(state.chunks);
+  free(state.reactors);
+}
+
+/**
+ * @return Maximum amount of opened sockets.
+ */
+static size_t sockets_limit(void) {
+  struct rlimit limit;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) || limit.rlim_cur == RLIM_INFINITY)
+    return SLOTS_DEFAULT_LIMIT;
+  return (size_t)limit.rlim_cur;
+}
+
+/**
+ * Creates one more server socket listening the same address.
+ * If SO_REUSEPORT is not supported, shares original socket.
+ *
+ * @param server_socket Original server socket.
+ *
+ * @return New server socket.
+ */
+static int clone_server_socket(int server_socket) {
+#ifdef SO_REUSEPORT
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  int value = 1;
+  int sock;
+
+  if (getsockname(server_socket, (struct sockaddr*)&addr, &len))
+    return server_socket;
+
+  sock = socket(addr.ss_family, SOCK_STREAM, 0);
+  if (sock == -1)
+    return server_socket;
+
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) ||
+      bind(sock, (struct sockaddr*)&addr, len) ||
+      listen(sock, LISTEN_BACKLOG)) {
+    perror("Cannot create reactor server socket");
+    close(sock);
+    return server_socket;
   }
-  memset(state._polls_copy, 0, sizeof(struct pollfd) * state.size);
-  memset(state._callbacks_copy, 0, sizeof(callback_t) * state.size);
-
-  if ((error = pthread_mutex_init(&state.lock, NULL)) != 0) {
-    free(state._callbacks_copy);
-    free(state._polls_copy);
-    free(state.callbacks);
-    free(state.polls);
+
+  fcntl(sock, F_SETFL, O_NONBLOCK);
+  return sock;
+#else
+  return server_socket;
+#endif
+}
+
+/**
+ * Initializes reactor and starts listening for clients.
+ *
+ * @param reactor Target reactor.
+ * @param server_socket Socket for receiving new clients.
+ */
+static int init_reactor(sockets_reactor_t* reactor, int server_socket) {
+  int error;
+
+  if ((error = pthread_mutex_init(&reactor->lock, NULL)) != 0)
+    return error;
+
+  if ((error = sockets_backend_init(&reactor->backend)) != 0) {
+    pthread_mutex_destroy(&reactor->lock);
     return error;
   }
 
-  state.polls_count = state._polls_count_copy = 2;
-  state.polls[0].fd = state._polls_copy[0].fd = server_socket;
-  state.polls[0].events = state._polls_copy[0].events = POLLIN | POLLPRI;
-  state.polls[1].fd = state._polls_copy[1].fd = pipes[0];
-  state.polls[1].events = state._polls_copy[1].events = POLLIN | POLLPRI;
+  reactor->server_socket = server_socket;
+  memset(&reactor->server, 0, sizeof(socket_slot_t));
+  reactor->server.socket = server_socket;
+  reactor->server.used = true;
+  reactor->server.events = POLLIN | POLLPRI;
+  if (!sockets_backend_add(reactor->backend, &reactor->server) ||
+      !sockets_backend_commit(reactor->backend)) {
+    sockets_backend_destroy(reactor->backend);
+    pthread_mutex_destroy(&reactor->lock);
+    return EINVAL;
+  }
 
   return 0;
 }
 
 /**
- * Prepares new dataset for poll execution.
- * Copy new sockets, flags and callbacks from polls and callbacks
- * state fields to _polls_copy and _callbacks_copy fields.
+ * Initializes socket processing.
+ * Partially initialized state is freed on destroy.
  *
- * @return {@code true} if success, or {@code false} and sets errno value.
+ * @param server_socket Socket for receiving new clients.
+ * @param reactors Amount of reactors.
  */
-static bool copy_state() {
-  if (!state.changed) {
-    pthread_mutex_unlock(&state.lock);
-    return true;
-  }
+static int init_sockets_state(int server_socket, size_t reactors) {
+  size_t chunks_count =
+      (sockets_limit() + SLOTS_CHUNK_SIZE - 1) / SLOTS_CHUNK_SIZE;
+  int error;
 
-  if (state._size_copy < state.size) {
-    state._polls_copy = (struct pollfd*)realloc(
-        state._polls_copy, sizeof(struct pollfd) * state.size);
-    if (state._polls_copy == NULL)
-      return false;
-    state._callbacks_copy = (callback_t*)realloc(
-        state._callbacks_copy, sizeof(callback_t) * state.size);
-    if (state._callbacks_copy == NULL)
-      return false;
+  state.server_socket = server_socket;
+  state.next_reactor = 0;
+  state.reactors_count = 0;
+  state.chunks = (socket_slot_t**)calloc(chunks_count, sizeof(socket_slot_t*));
+  if (state.chunks == NULL)
+    return errno;
+  state.chunks_count = chunks_count;
+
+  state.reactors =
+      (sockets_reactor_t*)calloc(reactors, sizeof(sockets_reactor_t));
+  if (state.reactors == NULL)
+    return errno;
 
-    state._size_copy = state.size;
+  for (size_t i = 0; i < reactors; i++) {
+    int sock = i == 0 ? server_socket : clone_server_socket(server_socket);
+    error = init_reactor(&state.reactors[i], sock);
+    if (error) {
+      if (sock != server_socket)
+        close(sock);
+      break;
+    }
+    state.reactors_count++;
   }
 
-  // Check if new data contains less sockets than old
-  if (state._polls_count_copy > state.polls_count) {
-    size_t diff = state._polls_count_copy - state.polls_count;
-    memset(state._polls_copy + state.polls_count, 0,
-           sizeof(struct pollfd) * diff);
-    memset(state._callbacks_copy + state.polls_count, 0,
-           sizeof(callback_t) * diff);
+  // Work with already created reactors
+  return state.reactors_count == 0 ? error : 0;
+}
+
+/**
+ * Makes reactor the home of socket slot, so the socket will be handled
+ * by the reactor accepted it.
+ * Slot stays in previous reactor, if it still referenced by its backend.
+ *
+ * @param slot Slot of accepted socket.
+ * @param reactor Locked current reactor.
+ */
+static void assign_slot_reactor(socket_slot_t* slot,
+                                sockets_reactor_t* reactor) {
+  sockets_reactor_t* home = __atomic_load_n(&slot->reactor, __ATOMIC_ACQUIRE);
+
+  if (home == reactor)
+    return;
+
+  if (home == NULL) {
+    __atomic_store_n(&slot->reactor, reactor, __ATOMIC_RELEASE);
+    return;
   }
 
-  memcpy(state._polls_copy, state.polls,
-         sizeof(struct pollfd) * state.polls_count);
-  memcpy(state._callbacks_copy, state.callbacks,
-         sizeof(callback_t) * state.polls_count);
-  state._polls_count_copy = state.polls_count;
+  // Reactors can not wait each other
+  if (pthread_mutex_trylock(&home->lock))
+    return;
 
-  state.changed = true;
+  if (slot->reactor == home && !slot->used &&
+      sockets_backend_released(home->backend, slot))
+    __atomic_store_n(&slot->reactor, reactor, __ATOMIC_RELEASE);
 
-  return true;
+  pthread_mutex_unlock(&home->lock);
 }
 
 /**
- * Handles poll syscall result.
- *
- * @param count Amount of updated sockets.
+ * Accepts new clients from reactor server socket.
+ * Called without reactor lock, because new clients are registered
+ * in the same reactor.
  *
  * @return {@code true} if success.
  */
-static bool handle_polls_update(size_t count) {
-  int revents, socket;
-  char buffer[BUFFER_SIZE];
-  ssize_t result;
+static bool handle_server_socket(sockets_reactor_t* reactor, int revents) {
+  socket_slot_t* slot;
+  int socket;
+
+  if (!(revents & POLLPRI || revents & POLLIN)) {
+    fprintf(stderr, "Cannot accept new clients\n");
+    // Original socket can be used by other reactors until destroy
+    if (reactor->server_socket != state.server_socket) {
+      close(reactor->server_socket);
+      reactor->server_socket = -1;
+    }
+    return false;
+  }
 
-  for (size_t i = 0; i < state._polls_count_copy; i++) {
-    if (count == 0)
+  for (int i = 0; i < ACCEPT_BATCH_SIZE; i++) {
+    socket = accept(reactor->server_socket, NULL, NULL);
+    if (socket == -1)
       break;
 
-    revents = state._polls_copy[i].revents;
-    state._polls_copy[i].revents = 0;
+    slot = slot_at(socket, true);
+    if (slot != NULL)
+      assign_slot_reactor(slot, reactor);
 
-    // Skip sockets unchanged
-    if (revents == 0)
-      continue;
-    count--;
-
-    // Handle server socket
-    if (i == 0) {
-      if (revents & POLLPRI || revents & POLLIN) {
-        socket = accept(state._polls_copy[0].fd, NULL, NULL);
-        fcntl(socket, F_SETFL, O_NONBLOCK);
-        proxy_log("Accept new client socket: %d", socket);
-        proxy_accept_client(socket);
-      } else {
-        fprintf(stderr, "Cannot accept new clients\n");
-        close(state._polls_copy[0].fd);
-        return false;
-      }
+    fcntl(socket, F_SETFL, O_NONBLOCK);
+    proxy_log("Accept new client socket: %d", socket);
+    proxy_accept_client(socket);
+  }
+
+  return true;
+}
+
+/**
+ * Handles ready sockets.
+ * Each reported socket is suspended until handler resumes it.
+ *
+ * @param reactor Current reactor.
+ * @param events Ready sockets.
+ * @param count Amount of ready sockets.
+ */
+static void handle_polls_update(sockets_reactor_t* reactor,
+                                sockets_event_t* events,
+                                int count) {
+  for (int i = 0; i < count; i++) {
+    if (events[i].socket == reactor->server_socket)
       continue;
-    }
 
-    // Handle signal pipe
-    if (i == 1) {
-      if (revents & POLLPRI || revents & POLLIN) {
-        result = read(state._polls_copy[1].fd, buffer, BUFFER_SIZE);
-        if (result < 0) {
-          perror("Cannot handle signal pipe");
-          close(state._polls_copy[1].fd);
-          return false;
-        }
-      } else {
-        fprintf(stderr, "Cannot handle signal pipe\n");
-        close(state._polls_copy[1].fd);
-        return false;
-      }
+    socket_slot_t* slot = slot_at(events[i].socket, false);
+
+    // Skip removed, reused or still handled sockets
+    if (slot == NULL || !slot->used || slot->reactor != reactor ||
+        slot->generation != events[i].generation || slot->suspended)
       continue;
-    }
 
-    callback_t* cb = &state._callbacks_copy[i];
-    if (cb->arg == state.callbacks[i].arg)  // Skip moved connections
-      cb->callback(state._polls_copy[i].fd, revents, cb->arg);
+    slot->suspended = true;
+    sockets_backend_suspend(reactor->backend, slot);
+
+    slot->callback(slot->socket, events[i].revents, slot->arg);
+  }
+}
+
+/**
+ * Places slot to reactor heap position.
+ */
+static void place_timer(sockets_reactor_t* reactor,
+                        size_t pos,
+                        socket_slot_t* slot) {
+  reactor->timers[pos] = slot;
+  slot->timer_pos = pos + 1;
+}
+
+/**
+ * Moves slot up or down the reactor heap, until heap order is restored.
+ * Must be called with reactor lock held.
+ */
+static void sift_timer(sockets_reactor_t* reactor, socket_slot_t* slot) {
+  socket_slot_t** timers = reactor->timers;
+  size_t count = reactor->timers_count;
+  size_t pos = slot->timer_pos - 1, child;
+
+  while (pos > 0 && timers[(pos - 1) / 2]->deadline > slot->deadline) {
+    place_timer(reactor, pos, timers[(pos - 1) / 2]);
+    pos = (pos - 1) / 2;
+  }
+
+  while ((child = pos * 2 + 1) < count) {
+    if (child + 1 < count &&
+        timers[child + 1]->deadline < timers[child]->deadline)
+      child++;
+    if (slot->deadline <= timers[child]->deadline)
+      break;
+    place_timer(reactor, pos, timers[child]);
+    pos = child;
+  }
+
+  place_timer(reactor, pos, slot);
+}
+
+/**
+ * Adds slot with deadline to reactor heap.
+ * Must be called with reactor lock held.
+ *
+ * @return {@code true} if success.
+ */
+static bool push_timer(sockets_reactor_t* reactor, socket_slot_t* slot) {
+  if (reactor->timers_count >= reactor->timers_size) {
+    size_t new_size = reactor->timers_size
+                          ? reactor->timers_size * TIMERS_GROW_SPEED
+                          : TIMERS_PRE_SIZE;
+    socket_slot_t** timers = (socket_slot_t**)realloc(
+        reactor->timers, new_size * sizeof(socket_slot_t*));
+    if (timers == NULL) {
+      perror("Cannot allocate sockets timer");
+      return false;
+    }
+    reactor->timers = timers;
+    reactor->timers_size = new_size;
   }
 
+  place_timer(reactor, reactor->timers_count++, slot);
+  sift_timer(reactor, slot);
+
   return true;
 }
 
-int sockets_poll_loop(int server_socket) {
-  int count, error;
+/**
+ * Removes slot from reactor heap, if it has timer.
+ * Must be called with reactor lock held.
+ */
+static void remove_timer(sockets_reactor_t* reactor, socket_slot_t* slot) {
+  if (slot->timer_pos == 0)
+    return;
 
-  error = init_sockets_state(server_socket);
-  if (error) {
-    proxy_error(error, "Cannot init sockets state");
+  size_t pos = slot->timer_pos - 1;
+  socket_slot_t* last = reactor->timers[--reactor->timers_count];
+
+  slot->timer_pos = 0;
+  slot->deadline = 0;
+  if (last == slot)
+    return;
+
+  place_timer(reactor, pos, last);
+  sift_timer(reactor, last);
+}
+
+/**
+ * Calculates waiting time until the nearest timer.
+ * Must be called with reactor lock held.
+ *
+ * @return Milliseconds or {@code -1} if there are no timers.
+ */
+static int next_timeout(sockets_reactor_t* reactor, long long now) {
+  if (reactor->timers_count == 0)
     return -1;
+
+  long long left = reactor->timers[0]->deadline - now;
+  if (left <= 0)
+    return 0;
+  return left > INT_MAX ? INT_MAX : (int)left;
+}
+
+/**
+ * Notifies sockets about expired timeouts.
+ * Timeout is reported even for suspended socket.
+ * Must be called with reactor lock held.
+ *
+ * @param reactor Current reactor.
+ * @param now Current monotonic time.
+ */
+static void handle_timers(sockets_reactor_t* reactor, long long now) {
+  while (reactor->timers_count > 0 && reactor->timers[0]->deadline <= now) {
+    socket_slot_t* slot = reactor->timers[0];
+    remove_timer(reactor, slot);
+    slot->callback(slot->socket, SOCKETS_TIMEOUT, slot->arg);
   }
+}
 
-  fcntl(server_socket, F_SETFL, O_NONBLOCK);
-  listen(server_socket, POLL_PRE_SIZE);
+/**
+ * Reactor events loop.
+ *
+ * @param reactor Current reactor.
+ *
+ * @return {@code 0} if stopped or error code.
+ */
+static int reactor_loop(sockets_reactor_t* reactor) {
+  sockets_event_t events[EVENTS_BATCH_SIZE];
+  int count, timeout, error;
+
+  current_reactor = reactor;
 
-  while (1) {
-    if ((count = poll(state._polls_copy, (nfds_t)state._polls_count_copy,
-                      -1)) == -1) {
-      if (errno == EINTR && copy_state())
+  while (!state.stopping) {
+    error = pthread_mutex_lock(&reactor->lock);
+    if (error)
+      return error;
+    timeout = next_timeout(reactor, proxy_current_millis());
+    pthread_mutex_unlock(&reactor->lock);
+
+    count = sockets_backend_wait(reactor->backend, events, EVENTS_BATCH_SIZE,
+                                 timeout);
+    if (count == -1) {
+      if (errno == EINTR)
         continue;
-      break;
+      return errno;
+    }
+
+    // Clients of failed reactor are not handled, so all reactors stop
+    for (int i = 0; i < count; i++) {
+      if (events[i].socket == reactor->server_socket &&
+          !handle_server_socket(reactor, events[i].revents)) {
+        state.server_failed = true;
+        sockets_stop();
+        return 0;
+      }
     }
 
-    error = pthread_mutex_lock(&state.lock);
+    error = pthread_mutex_lock(&reactor->lock);
     if (error)
-      break;
+      return error;
 
-    if (!handle_polls_update(count)) {
-      pthread_mutex_unlock(&state.lock);
-      return 1;
-    }
+    handle_polls_update(reactor, events, count);
+    handle_timers(reactor, proxy_current_millis());
 
-    if (!copy_state()) {
-      pthread_mutex_unlock(&state.lock);
-      break;
+    if (!sockets_backend_commit(reactor->backend)) {
+      error = errno;
+      pthread_mutex_unlock(&reactor->lock);
+      return error;
     }
 
-    error = pthread_mutex_unlock(&state.lock);
+    error = pthread_mutex_unlock(&reactor->lock);
     if (error)
-      break;
+      return error;
   }
 
-  proxy_error(error, "Cannot handle sockets");
-  return -1;
+  return 0;
 }
 
-#define LOCK_POLLS()                                   \
-  {                                                    \
-    int error = pthread_mutex_lock(&state.lock);       \
-    if (error) {                                       \
-      proxy_error(error, "Cannot lock sockets state"); \
-      return false;                                    \
-    }                                                  \
+/**
+ * Additional reactor thread routine.
+ */
+static void* reactor_thread(void* arg) {
+  int error = reactor_loop((sockets_reactor_t*)arg);
+  if (error) {
+    proxy_error(error, "Cannot handle sockets");
+    state.reactor_failed = true;
+    sockets_stop();
   }
+  return NULL;
+}
 
-#define UNLOCK_POLLS() pthread_mutex_unlock(&state.lock);
+/**
+ * Stops additional reactors and waits for their threads.
+ *
+ * @param started Amount of started reactors including the first one.
+ */
+static void join_reactors(size_t started) {
+  int error;
 
-#define NOTIFY_HANDLER()                       \
-  {                                            \
-    if (write(state.signal_pipe, "", 1) < 0) { \
-      perror("Cannot send signal to pipe");    \
-      return false;                            \
-    }                                          \
+  sockets_stop();
+  for (size_t i = 1; i < started; i++) {
+    error = pthread_join(state.reactors[i].thread, NULL);
+    if (error)
+      proxy_error(error, "Cannot join reactor thread");
   }
+}
 
-bool sockets_add_socket(int socket,
-                        void (*callback)(int, int, void*),
-                        void* arg) {
-  LOCK_POLLS();
-
-  if (state.polls_count + 1 >= state.size) {
-    size_t size = state.size * POLL_GROW_SPEED;
-    struct pollfd* temp_polls =
-        (struct pollfd*)realloc(state.polls, size * sizeof(struct pollfd));
-    if (temp_polls == NULL) {
-      perror("Cannot increase sockets poll size");
-      return false;
-    }
-    state.polls = temp_polls;
+int sockets_poll_loop(int server_socket, size_t reactors) {
+  size_t started;
+  int error;
 
-    callback_t* temp_callbacks =
-        (callback_t*)realloc(state.callbacks, size * sizeof(callback_t));
-    if (temp_callbacks == NULL) {
-      perror("Cannot increase sockets callbacks size");
-      return false;
-    }
-    state.callbacks = temp_callbacks;
+  if (reactors == 0)
+    reactors = 1;
 
-    memset(state.polls + state.size, 0, size - state.size);
-    memset(state.callbacks + state.size, 0, size - state.size);
-    state.size = size;
+  fcntl(server_socket, F_SETFL, O_NONBLOCK);
+  listen(server_socket, LISTEN_BACKLOG);
+
+  error = init_sockets_state(server_socket, reactors);
+  if (error) {
+    proxy_error(error, "Cannot init sockets state");
+    return -1;
   }
 
-  state.polls[state.polls_count].fd = socket;
-  state.polls[state.polls_count].events = 0;
-  state.callbacks[state.polls_count].callback = callback;
-  state.callbacks[state.polls_count].arg = arg;
-  state.polls_count++;
+  for (started = 1; started < state.reactors_count; started++) {
+    error = pthread_create(&state.reactors[started].thread, NULL,
+                           &reactor_thread, &state.reactors[started]);
+    if (error) {
+      proxy_error(error, "Cannot create reactor thread");
+      join_reactors(started);
+      return -1;
+    }
+  }
 
-  state.changed = true;
+  proxy_log("Started %zu sockets reactors", state.reactors_count);
 
-  UNLOCK_POLLS();
+  error = reactor_loop(&state.reactors[0]);
+  join_reactors(started);
 
-  // Do not notify about new socket, because no events set.
-  return true;
+  if (error) {
+    proxy_error(error, "Cannot handle sockets");
+    return -1;
+  }
+  if (state.reactor_failed)
+    return -1;
+  return state.server_failed ? 1 : 0;
 }
 
-/**
- * Looking for a socket in the registered list.
- *
- * @param socket Required socket.
- *
- * @return Required socket position or {@code -1}.
- */
-static ssize_t find_socket(int socket) {
-  for (size_t i = 0; i < state.polls_count; i++)
-    if (socket == state.polls[i].fd)
-      return i;
-  return -1;
+void sockets_stop(void) {
+  state.stopping = true;
+  for (size_t i = 0; i < state.reactors_count; i++)
+    sockets_backend_wakeup(state.reactors[i].backend);
 }
 
-bool sockets_enable_in_handle(int socket) {
-  LOCK_POLLS();
+bool sockets_add_socket(int socket,
+                        void (*callback)(int, int, void*),
+                        void* arg) {
+  sockets_reactor_t* reactor;
+  int error;
 
-  ssize_t pos = find_socket(socket);
-  if (pos == -1) {
-    UNLOCK_POLLS();
+  // Stopped reactors do not handle new sockets
+  if (state.stopping)
     return false;
-  }
 
-  state.polls[pos].events |= POLLIN | POLLPRI;
+  socket_slot_t* slot = slot_at(socket, true);
+  if (slot == NULL) {
+    fprintf(stderr, "Socket %d exceeds sockets limit\n", socket);
+    return false;
+  }
 
-  state.changed = true;
+  // Prefer home reactor of the socket, then current one
+  reactor = __atomic_load_n(&slot->reactor, __ATOMIC_ACQUIRE);
+  if (reactor == NULL)
+    reactor = current_reactor;
+  if (reactor == NULL)
+    reactor = &state.reactors[__atomic_fetch_add(&state.next_reactor, 1,
+                                                 __ATOMIC_RELAXED) %
+                              state.reactors_count];
 
-  UNLOCK_POLLS();
+  error = pthread_mutex_lock(&reactor->lock);
+  if (error) {
+    proxy_error(error, "Cannot lock sockets reactor");
+    return false;
+  }
 
-  NOTIFY_HANDLER();
-  return true;
-}
+  // Home reactor can be changed by accept before lock
+  if (slot->reactor != NULL && slot->reactor != reactor) {
+    pthread_mutex_unlock(&reactor->lock);
+    return sockets_add_socket(socket, callback, arg);
+  }
 
-bool sockets_enable_out_handle(int socket) {
-  LOCK_POLLS();
-  ssize_t pos = find_socket(socket);
-  if (pos == -1) {
-    UNLOCK_POLLS();
+  if (slot->used) {
+    fprintf(stderr, "Socket %d already registered\n", socket);
+    pthread_mutex_unlock(&reactor->lock);
     return false;
   }
 
-  state.polls[pos].events |= POLLOUT;
-
-  state.changed = true;
+  slot->socket = socket;
+  slot->generation++;
+  slot->events = 0;
+  slot->suspended = false;
+  slot->deadline = 0;
+  slot->timer_pos = 0;
+  slot->callback = callback;
+  slot->arg = arg;
+
+  if (!sockets_backend_add(reactor->backend, slot)) {
+    pthread_mutex_unlock(&reactor->lock);
+    return false;
+  }
+  slot->used = true;
+  __atomic_store_n(&slot->reactor, reactor, __ATOMIC_RELEASE);
 
-  UNLOCK_POLLS();
+  pthread_mutex_unlock(&reactor->lock);
 
-  NOTIFY_HANDLER();
   return true;
 }
 
-bool sockets_enable_io_handle(int socket) {
-  LOCK_POLLS();
-  ssize_t pos = find_socket(socket);
-  if (pos == -1) {
-    UNLOCK_POLLS();
+/**
+ * Changes events mask of registered socket.
+ *
+ * @param socket Required socket.
+ * @param enable Events required to enable.
+ * @param cancel Events required to disable.
+ *
+ * @return {@code true} if events mask changed.
+ */
+static bool change_socket_events(int socket, int enable, int cancel) {
+  socket_slot_t* slot;
+  bool result;
+
+  sockets_reactor_t* reactor = lock_slot(socket, &slot);
+  if (reactor == NULL)
     return false;
-  }
 
-  state.polls[pos].events |= POLLOUT | POLLIN | POLLPRI;
+  slot->events = (slot->events | enable) & ~cancel;
+  result = slot->suspended || sockets_backend_modify(reactor->backend, slot);
 
-  state.changed = true;
+  pthread_mutex_unlock(&reactor->lock);
 
-  UNLOCK_POLLS();
+  return result;
+}
 
-  NOTIFY_HANDLER();
-  return true;
+bool sockets_enable_in_handle(int socket) {
+  return change_socket_events(socket, POLLIN | POLLPRI, 0);
 }
 
-bool sockets_cancel_in_handle(int socket) {
-  LOCK_POLLS();
-  ssize_t pos = find_socket(socket);
-  if (pos == -1) {
-    UNLOCK_POLLS();
-    return false;
-  }
+bool sockets_enable_out_handle(int socket) {
+  return change_socket_events(socket, POLLOUT, 0);
+}
 
-  state.polls[pos].events &= ~(POLLIN | POLLPRI);
+bool sockets_enable_io_handle(int socket) {
+  return change_socket_events(socket, POLLOUT | POLLIN | POLLPRI, 0);
+}
 
-  state.changed = true;
+bool sockets_cancel_in_handle(int socket) {
+  return change_socket_events(socket, 0, POLLIN | POLLPRI);
+}
 
-  UNLOCK_POLLS();
+bool sockets_cancel_out_handle(int socket) {
+  return change_socket_events(socket, 0, POLLOUT);
+}
 
-  NOTIFY_HANDLER();
-  return true;
+bool sockets_cancel_io_handle(int socket) {
+  return change_socket_events(socket, 0, POLLOUT | POLLIN | POLLPRI);
 }
 
-bool sockets_cancel_out_handle(int socket) {
-  LOCK_POLLS();
-  ssize_t pos = find_socket(socket);
-  if (pos == -1) {
-    UNLOCK_POLLS();
-    return false;
-  }
+bool sockets_resume_handle(int socket) {
+  socket_slot_t* slot;
+  bool result = true;
 
-  state.polls[pos].events &= ~POLLOUT;
+  sockets_reactor_t* reactor = lock_slot(socket, &slot);
+  if (reactor == NULL)
+    return false;
 
-  state.changed = true;
+  if (slot->suspended) {
+    slot->suspended = false;
+    result = sockets_backend_modify(reactor->backend, slot);
+  }
 
-  UNLOCK_POLLS();
+  pthread_mutex_unlock(&reactor->lock);
 
-  NOTIFY_HANDLER();
-  return true;
+  return result;
 }
 
-bool sockets_cancel_io_handle(int socket) {
-  LOCK_POLLS();
-  ssize_t pos = find_socket(socket);
-  if (pos == -1) {
+bool sockets_set_timeout(int socket, long timeout) {
+  socket_slot_t* slot;
+  bool result = true;
+
+  sockets_reactor_t* reactor = lock_slot(socket, &slot);
+  if (reactor == NULL)
     return false;
-  }
 
-  state.polls[pos].events &= ~(POLLOUT | POLLIN | POLLPRI);
+  if (timeout < 0) {
+    remove_timer(reactor, slot);
+    pthread_mutex_unlock(&reactor->lock);
+    return true;
+  }
 
-  state.changed = true;
+  long long deadline = proxy_current_millis() + timeout;
 
-  UNLOCK_POLLS();
+  // Reactor waits for previous nearest timer, so it is woken up
+  bool nearest = reactor->timers_count == 0 ||
+                 deadline < reactor->timers[0]->deadline;
 
-  NOTIFY_HANDLER();
-  return true;
-}
+  // Existing timer is moved within heap
+  slot->deadline = deadline;
+  if (slot->timer_pos != 0) {
+    sift_timer(reactor, slot);
+  } else if (!push_timer(reactor, slot)) {
+    slot->deadline = 0;
+    result = false;
+  }
 
-static void remove_socket_at(size_t pos) {
-  state.polls_count--;
+  if (result && nearest && reactor != current_reactor)
+    result = sockets_backend_wakeup(reactor->backend);
 
-  memcpy(&state.polls[pos], &state.polls[state.polls_count],
-         sizeof(struct pollfd));
-  memset(&state.polls[state.polls_count], 0, sizeof(struct pollfd));
+  pthread_mutex_unlock(&reactor->lock);
 
-  memcpy(&state.callbacks[pos], &state.callbacks[state.polls_count],
-         sizeof(callback_t));
-  memset(&state.callbacks[state.polls_count], 0, sizeof(callback_t));
+  return result;
 }
 
-bool sockets_remove_socket(int socket) {
-  LOCK_POLLS();
-
-  // Pre notify for closing sockets
-  NOTIFY_HANDLER();
+bool sockets_detach_socket(int socket) {
+  socket_slot_t* slot;
 
-  ssize_t pos = find_socket(socket);
-  if (pos == -1) {
-    UNLOCK_POLLS();
+  sockets_reactor_t* reactor = lock_slot(socket, &slot);
+  if (reactor == NULL)
     return false;
-  }
 
-  remove_socket_at(pos);
+  sockets_backend_remove(reactor->backend, slot);
+  remove_timer(reactor, slot);
 
-  state.changed = true;
+  // Already received events for this slot will be skipped.
+  // Reactor stays home of the slot for next registration.
+  slot->used = false;
+  slot->generation++;
+  slot->callback = NULL;
+  slot->arg = NULL;
 
-  UNLOCK_POLLS();
+  pthread_mutex_unlock(&reactor->lock);
+
+  return true;
+}
+
+bool sockets_remove_socket(int socket) {
+  if (!sockets_detach_socket(socket))
+    return false;
 
   close(socket);
 
   return true;
 }
-
-#undef NOTIFY_HANDLER
-#undef UNLOCK_POLLS
-#undef LOCK_POLLS
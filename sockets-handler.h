@@ -1,18 +1,42 @@
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifndef _SOCKETS_HANDLER_H
 #define _SOCKETS_HANDLER_H
 
+// Reported to socket handler instead of poll events, when timeout expires
+#define SOCKETS_TIMEOUT 0x10000
+
 /**
  * Main loop of clients handling.
+ * Each reactor handles own sockets set in separate thread, current thread
+ * is used as first reactor. Additional reactors listen the same address
+ * using SO_REUSEPORT if supported.
  *
  * @param server_socket Socket for reciveing new clients.
+ * @param reactors Amount of reactors.
+ *
+ * @return {@code 0} if stopped, {@code 1} if server socket failed
+ * or {@code -1} if error occured. All reactors are stopped then.
  */
-int sockets_poll_loop(int server_socket);
+int sockets_poll_loop(int server_socket, size_t reactors);
+
+/**
+ * Requests reactors to stop and wakes them up.
+ * Can be called from signal handler.
+ */
+void sockets_stop(void);
+
+/**
+ * Notifies handlers of all registered sockets about hang up,
+ * so their connections are closed.
+ */
+void sockets_hangup(void);
 
 /**
  * Destroy sockets loop.
+ * Handlers must not use sockets anymore.
  */
 void sockets_destroy(void);
 
@@ -83,6 +107,41 @@ bool sockets_cancel_out_handle(int socket);
  */
 bool sockets_cancel_io_handle(int socket);
 
+/**
+ * Resumes events handling for added socket.
+ * After each callback invocation socket events handling is suspended
+ * until this function called, so the callback is not called again
+ * while socket is processed. Enabled and disabled events are stored
+ * meanwhile.
+ *
+ * @param socket Required socket.
+ *
+ * @return {@code true} if handle resumed.
+ */
+bool sockets_resume_handle(int socket);
+
+/**
+ * Sets timeout for added socket, replacing previous one.
+ * When it expires, socket handler is called with {@code SOCKETS_TIMEOUT}
+ * once, even if socket handling is suspended.
+ *
+ * @param socket Required socket.
+ * @param timeout Milliseconds or negative value to cancel timeout.
+ *
+ * @return {@code true} if timeout changed.
+ */
+bool sockets_set_timeout(int socket, long timeout);
+
+/**
+ * Removes socket from processing list without closing it,
+ * so it can be added again later.
+ *
+ * @param socket Required socket.
+ *
+ * @return {@code true} if socket detached.
+ */
+bool sockets_detach_socket(int socket);
+
 /**
  * Removes socket from processing list.
  *
@@ -0,0 +1,268 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "proxy-utils.h"
+#include "sockets-handler.h"
+
+#include "target-connector.h"
+
+// Recommended Connection Attempt Delay of RFC 8305
+#define CONNECTION_ATTEMPT_DELAY 250
+
+/**
+ * Searches for the next address of required family.
+ *
+ * @param same Required family is equal to {@code family} or differs.
+ *
+ * @return Found address or {@code NULL}.
+ */
+static struct addrinfo* next_of_family(struct addrinfo* address,
+                                       int family,
+                                       bool same) {
+  while (address != NULL && (address->ai_family == family) != same)
+    address = address->ai_next;
+
+  return address;
+}
+
+/**
+ * Orders resolved addresses, so families alternate starting with
+ * family of the first address.
+ *
+ * @return {@code true} if success.
+ */
+static bool order_candidates(target_connector_t* connector,
+                             struct addrinfo* addresses) {
+  size_t count = 0;
+
+  for (struct addrinfo* address = addresses; address != NULL;
+       address = address->ai_next)
+    count++;
+
+  connector->candidates =
+      (struct addrinfo**)malloc(count * sizeof(struct addrinfo*));
+  connector->attempts = (int*)malloc(count * sizeof(int));
+  if (connector->candidates == NULL || connector->attempts == NULL)
+    return false;
+
+  int family = addresses->ai_family;
+  struct addrinfo* first = addresses;
+  struct addrinfo* second = next_of_family(addresses, family, false);
+
+  while (first != NULL || second != NULL) {
+    if (first != NULL) {
+      connector->candidates[connector->candidates_count++] = first;
+      first = next_of_family(first->ai_next, family, true);
+    }
+    if (second != NULL) {
+      connector->candidates[connector->candidates_count++] = second;
+      second = next_of_family(second->ai_next, family, false);
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Starts non-blocking connection to the next candidate.
+ *
+ * @return {@code true} if attempt started.
+ */
+static bool start_attempt(target_connector_t* connector, long long now) {
+  struct addrinfo* address =
+      connector->candidates[connector->next_candidate++];
+
+  int sock = socket(address->ai_family, address->ai_socktype,
+                    address->ai_protocol);
+  if (sock < 0) {
+    connector->error = errno;
+    return false;
+  }
+
+  fcntl(sock, F_SETFL, O_NONBLOCK);
+
+  // Immediately connected socket is reported as ready too
+  if (connect(sock, address->ai_addr, address->ai_addrlen) < 0 &&
+      errno != EINPROGRESS) {
+    connector->error = errno;
+    close(sock);
+    return false;
+  }
+
+  if (!sockets_add_socket(sock, connector->callback, connector->arg)) {
+    connector->error = ENOMEM;
+    close(sock);
+    return false;
+  }
+  sockets_enable_out_handle(sock);
+
+  proxy_log("Connection attempt %zu started with socket %d",
+            connector->next_candidate, sock);
+  connector->attempts[connector->attempts_count++] = sock;
+  connector->next_attempt = now + CONNECTION_ATTEMPT_DELAY;
+  return true;
+}
+
+/**
+ * Starts attempts until one of them is in progress.
+ *
+ * @return {@code true} if some attempt is in progress.
+ */
+static bool start_next_attempt(target_connector_t* connector, long long now) {
+  while (connector->next_candidate < connector->candidates_count) {
+    if (start_attempt(connector, now))
+      return true;
+  }
+
+  return connector->attempts_count > 0;
+}
+
+/**
+ * Sets timeout of the newest attempt to the moment, when next attempt
+ * is started or connection fails.
+ *
+ * @return {@code true} if success.
+ */
+static bool schedule_wakeup(target_connector_t* connector, long long now) {
+  long long wakeup = connector->deadline;
+
+  if (connector->next_candidate < connector->candidates_count &&
+      connector->next_attempt < wakeup)
+    wakeup = connector->next_attempt;
+
+  long long timeout = wakeup > now ? wakeup - now : 0;
+  int newest = connector->attempts[connector->attempts_count - 1];
+  return sockets_set_timeout(newest,
+                             timeout > LONG_MAX ? LONG_MAX : (long)timeout);
+}
+
+bool target_connector_start(target_connector_t* connector,
+                            resolver_result_t* result,
+                            long timeout,
+                            void (*callback)(int, int, void*),
+                            void* arg) {
+  long long now = proxy_current_millis();
+
+  resolver_result_retain(result);
+  connector->result = result;
+  connector->deadline = now + timeout;
+  connector->callback = callback;
+  connector->arg = arg;
+
+  if (!order_candidates(connector, result->addresses)) {
+    connector->error = ENOMEM;
+    return false;
+  }
+
+  return start_next_attempt(connector, now) &&
+         schedule_wakeup(connector, now);
+}
+
+/**
+ * Closes attempt and removes it from attempts list.
+ */
+static void remove_attempt(target_connector_t* connector, size_t index) {
+  sockets_remove_socket(connector->attempts[index]);
+
+  connector->attempts_count--;
+  memmove(&connector->attempts[index], &connector->attempts[index + 1],
+          (connector->attempts_count - index) * sizeof(int));
+}
+
+/**
+ * Checks readiness of attempts.
+ * Failed attempts are removed.
+ *
+ * @return Index of connected attempt or {@code -1}.
+ */
+static int check_attempts(target_connector_t* connector) {
+  size_t count = connector->attempts_count;
+  socklen_t len = sizeof(int);
+  int error;
+
+  if (count == 0)
+    return -1;
+
+  struct pollfd polls[count];
+
+  for (size_t i = 0; i < count; i++) {
+    polls[i].fd = connector->attempts[i];
+    polls[i].events = POLLOUT;
+    polls[i].revents = 0;
+  }
+
+  if (poll(polls, (nfds_t)count, 0) <= 0)
+    return -1;
+
+  // Removed attempts shift the rest of list
+  size_t index = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (polls[i].revents == 0) {
+      index++;
+      continue;
+    }
+
+    error = 0;
+    if (getsockopt(polls[i].fd, SOL_SOCKET, SO_ERROR, &error, &len))
+      error = errno;
+    if (!error && polls[i].revents & POLLOUT)
+      return (int)index;
+
+    connector->error = error ? error : ECONNREFUSED;
+    proxy_log("Connection attempt with socket %d failed", polls[i].fd);
+    remove_attempt(connector, index);
+  }
+
+  return -1;
+}
+
+int target_connector_poll(target_connector_t* connector) {
+  long long now = proxy_current_millis();
+
+  int index = check_attempts(connector);
+  if (index != -1) {
+    int socket = connector->attempts[index];
+    sockets_detach_socket(socket);
+
+    connector->attempts_count--;
+    connector->attempts[index] =
+        connector->attempts[connector->attempts_count];
+    target_connector_free(connector);
+    return socket;
+  }
+
+  if (now >= connector->deadline) {
+    connector->error = ETIMEDOUT;
+    return -1;
+  }
+
+  // Failed attempt is replaced at once
+  if ((connector->attempts_count == 0 || now >= connector->next_attempt) &&
+      !start_next_attempt(connector, now))
+    return -1;
+
+  if (!schedule_wakeup(connector, now))
+    return -1;
+
+  for (size_t i = 0; i < connector->attempts_count; i++)
+    sockets_resume_handle(connector->attempts[i]);
+
+  return TARGET_CONNECTOR_PENDING;
+}
+
+void target_connector_free(target_connector_t* connector) {
+  for (size_t i = 0; i < connector->attempts_count; i++)
+    sockets_remove_socket(connector->attempts[i]);
+
+  free(connector->attempts);
+  free(connector->candidates);
+  resolver_result_release(connector->result);
+  memset(connector, 0, sizeof(target_connector_t));
+}
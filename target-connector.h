@@ -0,0 +1,72 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "resolver.h"
+
+#ifndef _TARGET_CONNECTOR_H
+#define _TARGET_CONNECTOR_H
+
+// Connection attempts are not finished yet
+#define TARGET_CONNECTOR_PENDING -2
+
+typedef struct target_connector {
+  resolver_result_t* result;
+  // Resolved addresses with alternating families
+  struct addrinfo** candidates;
+  size_t candidates_count;
+  size_t next_candidate;
+  // Sockets of attempts in progress, the newest last
+  int* attempts;
+  size_t attempts_count;
+  long long next_attempt;
+  long long deadline;
+  int error;
+  void (*callback)(int, int, void*);
+  void* arg;
+} target_connector_t;
+
+/**
+ * Starts connecting to resolved target addresses (Happy Eyeballs, RFC 8305).
+ * Addresses are tried in resolved order with alternating families,
+ * next attempt is started, when previous one fails or is not connected
+ * during attempt delay. Previous attempts are not interrupted, so
+ * the first connected socket is used.
+ * Attempt sockets are added for processing with required handler,
+ * which is called when some attempt is ready or its delay expires.
+ *
+ * @param connector Zeroed connector.
+ * @param result Resolved addresses referenced by connector.
+ * @param timeout Milliseconds, while connection is established.
+ * @param callback Attempt sockets handler.
+ * @param arg Argument for attempt sockets handler.
+ *
+ * @return {@code true} if the first attempt started, otherwise connector
+ * error is set. Connector must be freed in both cases.
+ */
+bool target_connector_start(target_connector_t* connector,
+                            resolver_result_t* result,
+                            long timeout,
+                            void (*callback)(int, int, void*),
+                            void* arg);
+
+/**
+ * Checks attempts after their handler call and starts next ones.
+ * Failed attempts are closed, other ones are resumed.
+ * Must not be called concurrently for the same connector.
+ *
+ * @param connector Started connector.
+ *
+ * @return Connected socket, which is not handled by reactors,
+ * {@code TARGET_CONNECTOR_PENDING} or {@code -1} if all attempts failed,
+ * then connector error is set.
+ */
+int target_connector_poll(target_connector_t* connector);
+
+/**
+ * Closes attempts in progress and frees connector data.
+ *
+ * @param connector Zeroed, started or finished connector.
+ */
+void target_connector_free(target_connector_t* connector);
+
+#endif
@@ -0,0 +1,334 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "proxy-utils.h"
+#include "sockets-handler.h"
+#include "worker-pool.h"
+
+#include "target-pool.h"
+
+#define POOL_BUCKETS_COUNT 256
+
+struct pool_host;
+
+typedef struct pool_connection {
+  int socket;
+  // Set by reactor, when target closes connection or it is idle too long
+  bool expired;
+  struct pool_host* host;
+  // Connections of the same target, newest first
+  struct pool_connection* host_prev;
+  struct pool_connection* host_next;
+  // All connections, oldest first
+  struct pool_connection* prev;
+  struct pool_connection* next;
+} pool_connection_t;
+
+typedef struct pool_host {
+  char* name;
+  size_t count;
+  pool_connection_t* newest;
+  pool_connection_t* oldest;
+  struct pool_host* next;
+} pool_host_t;
+
+typedef struct target_pool {
+  pthread_mutex_t lock;
+  // Closes expired connections, since reactors cannot take pool lock
+  worker_task_t task;
+  pool_host_t* buckets[POOL_BUCKETS_COUNT];
+  pool_connection_t* oldest;
+  pool_connection_t* newest;
+  size_t count;
+  size_t max_idle;
+  size_t max_idle_per_host;
+  long idle_timeout;
+} target_pool_t;
+
+static target_pool_t pool;
+
+static bool pool_task_run(void* arg, int events);
+
+int target_pool_init(size_t max_idle,
+                     size_t max_idle_per_host,
+                     long idle_timeout) {
+  memset(&pool, 0, sizeof(target_pool_t));
+  worker_task_init(&pool.task, &pool_task_run, NULL);
+  pool.max_idle = max_idle;
+  pool.max_idle_per_host = max_idle_per_host;
+  pool.idle_timeout = idle_timeout;
+
+  return pthread_mutex_init(&pool.lock, NULL);
+}
+
+/**
+ * Selects bucket by FNV-1a hash of target name.
+ */
+static pool_host_t** bucket_of(const char* name) {
+  return &pool.buckets[fnv1a_hash(name) % POOL_BUCKETS_COUNT];
+}
+
+/**
+ * Searches for target with idle connections.
+ * Must be called with pool lock held.
+ *
+ * @return Found target or {@code NULL}.
+ */
+static pool_host_t* find_host(const char* name) {
+  pool_host_t* host = *bucket_of(name);
+
+  while (host != NULL && strcmp(host->name, name))
+    host = host->next;
+
+  return host;
+}
+
+/**
+ * Creates target record for idle connections.
+ * Must be called with pool lock held.
+ *
+ * @return Created target or {@code NULL}.
+ */
+static pool_host_t* create_host(const char* name) {
+  pool_host_t* host = (pool_host_t*)calloc(1, sizeof(pool_host_t));
+  if (host == NULL)
+    return NULL;
+
+  host->name = strdup(name);
+  if (host->name == NULL) {
+    free(host);
+    return NULL;
+  }
+
+  pool_host_t** bucket = bucket_of(name);
+  host->next = *bucket;
+  (*bucket) = host;
+
+  return host;
+}
+
+/**
+ * Frees target record without idle connections.
+ * Must be called with pool lock held.
+ */
+static void remove_host(pool_host_t* host) {
+  pool_host_t** link = bucket_of(host->name);
+
+  while (*link != host)
+    link = &(*link)->next;
+  (*link) = host->next;
+
+  free(host->name);
+  free(host);
+}
+
+/**
+ * Removes connection from pool, its target record is freed,
+ * when it has no more idle connections.
+ * Must be called with pool lock held.
+ *
+ * @return Connection socket, which is not handled by reactors.
+ */
+static int detach_connection(pool_connection_t* connection) {
+  pool_host_t* host = connection->host;
+  int socket = connection->socket;
+
+  // Reactor handler cannot use connection after that
+  sockets_detach_socket(socket);
+
+  if (connection->host_prev != NULL)
+    connection->host_prev->host_next = connection->host_next;
+  else
+    host->newest = connection->host_next;
+  if (connection->host_next != NULL)
+    connection->host_next->host_prev = connection->host_prev;
+  else
+    host->oldest = connection->host_prev;
+
+  if (connection->prev != NULL)
+    connection->prev->next = connection->next;
+  else
+    pool.oldest = connection->next;
+  if (connection->next != NULL)
+    connection->next->prev = connection->prev;
+  else
+    pool.newest = connection->prev;
+
+  pool.count--;
+  if (--host->count == 0)
+    remove_host(host);
+
+  free(connection);
+  return socket;
+}
+
+/**
+ * Closes connections marked expired by reactors.
+ * Must be called with pool lock held.
+ */
+static void close_expired(void) {
+  pool_connection_t* connection = pool.oldest;
+
+  while (connection != NULL) {
+    pool_connection_t* next = connection->next;
+    if (__atomic_load_n(&connection->expired, __ATOMIC_ACQUIRE))
+      close(detach_connection(connection));
+    connection = next;
+  }
+}
+
+/**
+ * Closes expired connections in worker thread.
+ */
+static bool pool_task_run(void* arg, int events) {
+  int error = pthread_mutex_lock(&pool.lock);
+  if (error) {
+    proxy_error(error, "Cannot lock target pool");
+    return true;
+  }
+
+  close_expired();
+  pthread_mutex_unlock(&pool.lock);
+  return true;
+}
+
+/**
+ * Handles input, hang up or idle timeout of pooled connection.
+ * Connection is closed by pool task, since reactor lock is taken
+ * after pool lock.
+ */
+static void handle_idle_connection(int socket, int events, void* arg) {
+  pool_connection_t* connection = (pool_connection_t*)arg;
+
+  __atomic_store_n(&connection->expired, true, __ATOMIC_RELEASE);
+  worker_pool_submit(&pool.task, events);
+}
+
+/**
+ * Checks, if idle connection was not closed by target.
+ * Idle target must not send anything, so any input means closing.
+ *
+ * @return {@code true} if connection can be used.
+ */
+static bool connection_alive(int socket) {
+  char byte;
+
+  ssize_t result = recv(socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int target_pool_acquire(const char* host) {
+  pool_host_t* record;
+  int socket = -1;
+  int error;
+
+  error = pthread_mutex_lock(&pool.lock);
+  if (error) {
+    proxy_error(error, "Cannot lock target pool");
+    return -1;
+  }
+
+  // Target record is freed with its last connection
+  while (socket == -1 && (record = find_host(host)) != NULL) {
+    bool expired = __atomic_load_n(&record->newest->expired, __ATOMIC_ACQUIRE);
+    socket = detach_connection(record->newest);
+    if (expired || !connection_alive(socket)) {
+      close(socket);
+      socket = -1;
+    }
+  }
+
+  pthread_mutex_unlock(&pool.lock);
+
+  return socket;
+}
+
+void target_pool_release(const char* host, int socket) {
+  pool_host_t* record;
+  int error;
+
+  if (pool.max_idle == 0 || pool.max_idle_per_host == 0 ||
+      pool.idle_timeout <= 0) {
+    close(socket);
+    return;
+  }
+
+  pool_connection_t* connection =
+      (pool_connection_t*)calloc(1, sizeof(pool_connection_t));
+  if (connection == NULL) {
+    close(socket);
+    return;
+  }
+
+  error = pthread_mutex_lock(&pool.lock);
+  if (error) {
+    proxy_error(error, "Cannot lock target pool");
+    free(connection);
+    close(socket);
+    return;
+  }
+
+  // Idle connection is closed, when target closes it or timeout expires
+  long timeout = pool.idle_timeout > LONG_MAX / 1000
+                     ? LONG_MAX
+                     : pool.idle_timeout * 1000;
+  if (!sockets_add_socket(socket, &handle_idle_connection, connection)) {
+    pthread_mutex_unlock(&pool.lock);
+    free(connection);
+    close(socket);
+    return;
+  }
+  sockets_enable_in_handle(socket);
+  sockets_set_timeout(socket, timeout);
+
+  if (pool.count >= pool.max_idle)
+    close(detach_connection(pool.oldest));
+  record = find_host(host);
+  if (record != NULL && record->count >= pool.max_idle_per_host)
+    close(detach_connection(record->oldest));
+
+  // Target record can be freed with its oldest connection
+  record = find_host(host);
+  if (record == NULL && (record = create_host(host)) == NULL) {
+    pthread_mutex_unlock(&pool.lock);
+    sockets_remove_socket(socket);
+    free(connection);
+    return;
+  }
+
+  connection->socket = socket;
+  connection->host = record;
+  connection->host_next = record->newest;
+  if (record->newest != NULL)
+    record->newest->host_prev = connection;
+  else
+    record->oldest = connection;
+  record->newest = connection;
+  record->count++;
+
+  connection->prev = pool.newest;
+  if (pool.newest != NULL)
+    pool.newest->next = connection;
+  else
+    pool.oldest = connection;
+  pool.newest = connection;
+  pool.count++;
+
+  pthread_mutex_unlock(&pool.lock);
+}
+
+void target_pool_free(void) {
+  pthread_mutex_lock(&pool.lock);
+  while (pool.oldest != NULL)
+    close(detach_connection(pool.oldest));
+  pthread_mutex_unlock(&pool.lock);
+
+  pthread_mutex_destroy(&pool.lock);
+}
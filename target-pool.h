@@ -0,0 +1,49 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef _TARGET_POOL_H
+#define _TARGET_POOL_H
+
+/**
+ * Initializes pool of idle persistent connections to proxying targets.
+ * Connections are reused by any client requesting the same target.
+ *
+ * @param max_idle Maximum amount of idle connections.
+ * @param max_idle_per_host Maximum amount of idle connections to one target.
+ * @param idle_timeout Seconds, after which idle connection is closed.
+ *
+ * @return {@code 0} if success or error code.
+ */
+int target_pool_init(size_t max_idle,
+                     size_t max_idle_per_host,
+                     long idle_timeout);
+
+/**
+ * Takes the most recently used idle connection to target.
+ * Connections closed by target meanwhile are dropped.
+ *
+ * @param host hostname[:port]
+ *
+ * @return Connected socket, which is not handled by reactors,
+ * or {@code -1} if there is no idle connection.
+ */
+int target_pool_acquire(const char* host);
+
+/**
+ * Returns connection, which completed response, to the pool.
+ * The oldest idle connections are closed, when limits are exceeded.
+ * Idle connection is handled by reactors, so it is closed, when target
+ * closes it or idle timeout expires.
+ *
+ * @param host hostname[:port]
+ * @param socket Connected socket, which is not handled by reactors.
+ */
+void target_pool_release(const char* host, int socket);
+
+/**
+ * Closes all idle connections.
+ * Must be called before sockets loop is destroyed.
+ */
+void target_pool_free(void);
+
+#endif
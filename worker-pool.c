@@ -0,0 +1,506 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "proxy-utils.h"
+
+#include "worker-pool.h"
+
+#define TASK_IDLE 0
+#define TASK_SCHEDULED 1
+#define TASK_RUNNING 2
+#define TASK_RUNNING_NOTIFIED 3
+
+#define DEQUE_PRE_SIZE 256
+#define NO_WORKER -1
+
+typedef struct deque_array {
+  long size;
+  worker_task_t** tasks;
+  struct deque_array* retired;
+} deque_array_t;
+
+/**
+ * Chase-Lev work-stealing deque.
+ * Only owner worker pushes and takes tasks from the bottom,
+ * other workers steal tasks from the top.
+ */
+typedef struct deque {
+  long top;
+  long bottom;
+  deque_array_t* array;
+} deque_t;
+
+typedef struct worker {
+  size_t index;
+  pthread_t thread;
+  deque_t deque;
+  worker_task_t* inbox;
+  unsigned int seed;
+  bool parked;
+  pthread_cond_t notifier;
+} worker_t;
+
+typedef struct worker_pool {
+  size_t workers_count;
+  worker_t* workers;
+  size_t next_worker;
+  size_t sleepers;
+  bool stopping;
+  bool drained;
+  pthread_mutex_t lock;
+} worker_pool_t;
+
+static worker_pool_t pool;
+
+/**
+ * Worker running in current thread.
+ */
+static __thread worker_t* current_worker;
+
+static deque_array_t* deque_array_create(long size) {
+  deque_array_t* array = (deque_array_t*)malloc(sizeof(deque_array_t));
+  if (array == NULL)
+    return NULL;
+
+  array->tasks = (worker_task_t**)calloc(size, sizeof(worker_task_t*));
+  if (array->tasks == NULL) {
+    free(array);
+    return NULL;
+  }
+  array->size = size;
+  array->retired = NULL;
+
+  return array;
+}
+
+static bool deque_init(deque_t* deque) {
+  deque->top = deque->bottom = 0;
+  deque->array = deque_array_create(DEQUE_PRE_SIZE);
+  return deque->array != NULL;
+}
+
+/**
+ * Grows deque array. Previous array can be still read by thieves,
+ * so it is retired until pool destruction.
+ */
+static deque_array_t* deque_grow(deque_t* deque, long top, long bottom) {
+  deque_array_t* array = deque->array;
+  deque_array_t* grown = deque_array_create(array->size * 2);
+  if (grown == NULL)
+    return NULL;
+
+  for (long i = top; i < bottom; i++)
+    grown->tasks[i % grown->size] = __atomic_load_n(
+        &array->tasks[i % array->size], __ATOMIC_RELAXED);
+  grown->retired = array;
+
+  __atomic_store_n(&deque->array, grown, __ATOMIC_RELEASE);
+  return grown;
+}
+
+/**
+ * Pushes task to the bottom of worker own deque.
+ *
+ * @return {@code false} if not enougth memory.
+ */
+static bool deque_push(deque_t* deque, worker_task_t* task) {
+  long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  deque_array_t* array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+
+  if (bottom - top > array->size - 1) {
+    array = deque_grow(deque, top, bottom);
+    if (array == NULL)
+      return false;
+  }
+
+  __atomic_store_n(&array->tasks[bottom % array->size], task,
+                   __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+/**
+ * Takes task from the bottom of worker own deque.
+ *
+ * @return Task or {@code NULL} if deque is empty.
+ */
+static worker_task_t* deque_take(deque_t* deque) {
+  long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  deque_array_t* array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+  worker_task_t* task = NULL;
+  long top;
+
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+  if (top <= bottom) {
+    task = __atomic_load_n(&array->tasks[bottom % array->size],
+                           __ATOMIC_RELAXED);
+    if (top == bottom) {
+      // Last task, race with thieves
+      if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        task = NULL;
+      __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+  } else
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+
+  return task;
+}
+
+/**
+ * Steals task from the top of other worker deque.
+ *
+ * @return Task or {@code NULL} if deque is empty or steal failed.
+ */
+static worker_task_t* deque_steal(deque_t* deque) {
+  long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  worker_task_t* task;
+
+  if (top >= bottom)
+    return NULL;
+
+  deque_array_t* array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+  task = __atomic_load_n(&array->tasks[top % array->size], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return NULL;
+
+  return task;
+}
+
+static bool deque_empty(deque_t* deque) {
+  return __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST) >=
+         __atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Pushes task to the worker inbox, which is drained by the worker
+ * to its own deque or by idle workers.
+ */
+static void inbox_push(worker_t* worker, worker_task_t* task) {
+  worker_task_t* head = __atomic_load_n(&worker->inbox, __ATOMIC_RELAXED);
+
+  do {
+    task->next = head;
+  } while (!__atomic_compare_exchange_n(&worker->inbox, &head, task, true,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+}
+
+/**
+ * Moves all tasks from worker inbox to current worker deque.
+ *
+ * @param worker Inbox owner.
+ * @param current Current worker.
+ *
+ * @return {@code true} if any task moved.
+ */
+static bool inbox_drain(worker_t* worker, worker_t* current) {
+  worker_task_t* task;
+  worker_task_t* next;
+
+  if (__atomic_load_n(&worker->inbox, __ATOMIC_RELAXED) == NULL)
+    return false;
+
+  task = __atomic_exchange_n(&worker->inbox, NULL, __ATOMIC_ACQUIRE);
+  if (task == NULL)
+    return false;
+
+  while (task) {
+    next = task->next;
+    if (!deque_push(&current->deque, task)) {
+      // Return task back, it will be lost otherwise
+      perror("Cannot grow worker deque");
+      inbox_push(worker, task);
+    }
+    task = next;
+  }
+
+  return true;
+}
+
+/**
+ * Looking for a task in other workers deques and inboxes.
+ */
+static worker_task_t* steal_task(worker_t* current) {
+  size_t start = (size_t)rand_r(&current->seed) % pool.workers_count;
+  worker_task_t* task;
+
+  for (size_t i = 0; i < pool.workers_count; i++) {
+    worker_t* victim = &pool.workers[(start + i) % pool.workers_count];
+    if (victim == current)
+      continue;
+
+    if ((task = deque_steal(&victim->deque)) != NULL)
+      return task;
+
+    if (inbox_drain(victim, current) &&
+        (task = deque_take(&current->deque)) != NULL)
+      return task;
+  }
+
+  return NULL;
+}
+
+/**
+ * @return {@code true} if any task is waiting for execution.
+ */
+static bool has_tasks(void) {
+  for (size_t i = 0; i < pool.workers_count; i++) {
+    worker_t* worker = &pool.workers[i];
+    if (__atomic_load_n(&worker->inbox, __ATOMIC_SEQ_CST) != NULL ||
+        !deque_empty(&worker->deque))
+      return true;
+  }
+
+  return false;
+}
+
+/**
+ * Waits until new task submitted.
+ * When pool is stopping, the last parked worker finds pool drained
+ * and wakes up others.
+ *
+ * @return {@code false} if pool is drained and worker must exit.
+ */
+static bool park_worker(worker_t* worker) {
+  int error = pthread_mutex_lock(&pool.lock);
+  if (error) {
+    proxy_error(error, "Cannot lock worker pool");
+    return true;
+  }
+
+  worker->parked = true;
+  __atomic_fetch_add(&pool.sleepers, 1, __ATOMIC_SEQ_CST);
+
+  // Submitters push task before checking sleepers
+  if (!pool.drained && !has_tasks()) {
+    if (pool.stopping && pool.sleepers == pool.workers_count) {
+      // Nothing is running, so nothing can be submitted by tasks
+      pool.drained = true;
+      for (size_t i = 0; i < pool.workers_count; i++)
+        pthread_cond_signal(&pool.workers[i].notifier);
+    } else {
+      error = pthread_cond_wait(&worker->notifier, &pool.lock);
+      if (error)
+        proxy_error(error, "Cannot wait worker condition");
+    }
+  }
+
+  __atomic_fetch_sub(&pool.sleepers, 1, __ATOMIC_SEQ_CST);
+  worker->parked = false;
+  bool drained = pool.drained;
+  pthread_mutex_unlock(&pool.lock);
+
+  return !drained;
+}
+
+/**
+ * Wakes up required worker if it is parked, otherwise any parked worker,
+ * which can steal the task.
+ */
+static void wakeup_worker(worker_t* worker) {
+  if (__atomic_load_n(&pool.sleepers, __ATOMIC_SEQ_CST) == 0)
+    return;
+
+  int error = pthread_mutex_lock(&pool.lock);
+  if (error) {
+    proxy_error(error, "Cannot lock worker pool");
+    return;
+  }
+
+  if (worker == NULL || !worker->parked) {
+    worker = NULL;
+    for (size_t i = 0; i < pool.workers_count && worker == NULL; i++)
+      if (pool.workers[i].parked)
+        worker = &pool.workers[i];
+  }
+
+  if (worker != NULL)
+    pthread_cond_signal(&worker->notifier);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+ * Runs task until no events left for it.
+ */
+static void run_task(worker_t* worker, worker_task_t* task) {
+  int expected, events;
+
+  // Next runs will be scheduled to this worker
+  __atomic_store_n(&task->worker, (int)worker->index, __ATOMIC_RELAXED);
+
+  while (1) {
+    // Sequential consistency pairs with worker_pool_submit
+    __atomic_store_n(&task->status, TASK_RUNNING, __ATOMIC_SEQ_CST);
+    events = __atomic_exchange_n(&task->events, 0, __ATOMIC_SEQ_CST);
+
+    // Task destroyed itself
+    if (!task->run(task->arg, events))
+      return;
+
+    expected = TASK_RUNNING;
+    if (__atomic_compare_exchange_n(&task->status, &expected, TASK_IDLE,
+                                    false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+      return;
+
+    // New events received while running
+  }
+}
+
+static void* worker_thread(void* arg) {
+  worker_t* worker = (worker_t*)arg;
+  worker_task_t* task;
+
+  current_worker = worker;
+
+  while (1) {
+    task = deque_take(&worker->deque);
+    if (task == NULL && inbox_drain(worker, worker))
+      task = deque_take(&worker->deque);
+    if (task == NULL)
+      task = steal_task(worker);
+
+    if (task == NULL) {
+      if (!park_worker(worker))
+        break;
+      continue;
+    }
+
+    // Other workers can steal rest of tasks
+    if (!deque_empty(&worker->deque))
+      wakeup_worker(NULL);
+
+    run_task(worker, task);
+  }
+
+  return NULL;
+}
+
+int worker_pool_init(size_t workers) {
+  int error;
+
+  pool.sleepers = 0;
+  pool.stopping = pool.drained = false;
+  pool.next_worker = 0;
+  pool.workers_count = 0;
+  pool.workers = (worker_t*)calloc(workers, sizeof(worker_t));
+  if (pool.workers == NULL)
+    return errno;
+
+  if ((error = pthread_mutex_init(&pool.lock, NULL)) != 0) {
+    free(pool.workers);
+    return error;
+  }
+
+  for (size_t i = 0; i < workers; i++) {
+    pool.workers[i].index = i;
+    pool.workers[i].seed = (unsigned int)i + 1;
+    pool.workers[i].inbox = NULL;
+    pool.workers[i].parked = false;
+    if (!deque_init(&pool.workers[i].deque))
+      return ENOMEM;
+    if ((error = pthread_cond_init(&pool.workers[i].notifier, NULL)) != 0)
+      return error;
+  }
+
+  // Workers can steal only from started workers
+  for (size_t i = 0; i < workers; i++) {
+    pool.workers_count = i + 1;
+    error = pthread_create(&pool.workers[i].thread, NULL, &worker_thread,
+                           &pool.workers[i]);
+    if (error) {
+      proxy_error(error, "Cannot create worker thread");
+      pool.workers_count = i;
+      if (i == 0)
+        return error;
+      break;
+    }
+  }
+
+  return 0;
+}
+
+void worker_pool_shutdown(void) {
+  int error = pthread_mutex_lock(&pool.lock);
+  if (error) {
+    proxy_error(error, "Cannot lock worker pool");
+    return;
+  }
+
+  // Parked workers check whether pool is drained
+  pool.stopping = true;
+  for (size_t i = 0; i < pool.workers_count; i++)
+    pthread_cond_signal(&pool.workers[i].notifier);
+  pthread_mutex_unlock(&pool.lock);
+
+  for (size_t i = 0; i < pool.workers_count; i++) {
+    error = pthread_join(pool.workers[i].thread, NULL);
+    if (error)
+      proxy_error(error, "Cannot join worker thread");
+  }
+}
+
+void worker_task_init(worker_task_t* task, bool (*run)(void*, int), void* arg) {
+  task->run = run;
+  task->arg = arg;
+  task->events = 0;
+  task->status = TASK_IDLE;
+  task->worker = NO_WORKER;
+  task->next = NULL;
+}
+
+/**
+ * Schedules task to the worker last executed it.
+ */
+static void schedule_task(worker_task_t* task) {
+  int index = __atomic_load_n(&task->worker, __ATOMIC_RELAXED);
+  size_t count = __atomic_load_n(&pool.workers_count, __ATOMIC_RELAXED);
+  worker_t* worker;
+
+  if (index == NO_WORKER || (size_t)index >= count)
+    index = (int)(__atomic_fetch_add(&pool.next_worker, 1, __ATOMIC_RELAXED) %
+                  count);
+  worker = &pool.workers[index];
+
+  if (worker == current_worker && deque_push(&worker->deque, task))
+    return;
+
+  inbox_push(worker, task);
+  wakeup_worker(worker);
+}
+
+void worker_pool_submit(worker_task_t* task, int events) {
+  int status;
+
+  __atomic_fetch_or(&task->events, events, __ATOMIC_SEQ_CST);
+
+  status = __atomic_load_n(&task->status, __ATOMIC_SEQ_CST);
+  while (1) {
+    if (status == TASK_IDLE) {
+      if (__atomic_compare_exchange_n(&task->status, &status, TASK_SCHEDULED,
+                                      false, __ATOMIC_ACQ_REL,
+                                      __ATOMIC_ACQUIRE)) {
+        schedule_task(task);
+        return;
+      }
+    } else if (status == TASK_RUNNING) {
+      if (__atomic_compare_exchange_n(&task->status, &status,
+                                      TASK_RUNNING_NOTIFIED, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return;
+    } else {
+      // Already scheduled or will be run again
+      return;
+    }
+  }
+}
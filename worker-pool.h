@@ -0,0 +1,55 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef _WORKER_POOL_H
+#define _WORKER_POOL_H
+
+typedef struct worker_task {
+  bool (*run)(void*, int);
+  void* arg;
+  int events;
+  int status;
+  int worker;
+  struct worker_task* next;
+} worker_task_t;
+
+/**
+ * Starts worker threads.
+ *
+ * @param workers Amount of worker threads.
+ *
+ * @return {@code 0} if success or error code.
+ */
+int worker_pool_init(size_t workers);
+
+/**
+ * Initializes task.
+ * Task routine receives events accumulated since previous run and
+ * returns {@code false} if task was destroyed by itself.
+ *
+ * @param task Target task.
+ * @param run Task routine.
+ * @param arg Argument for task routine.
+ */
+void worker_task_init(worker_task_t* task, bool (*run)(void*, int), void* arg);
+
+/**
+ * Schedules task execution with required events.
+ * Task is never executed by several workers at the same time,
+ * events received while it is running cause one more run.
+ * Task is scheduled to the worker last executed it, idle workers
+ * steal tasks from busy ones.
+ *
+ * @param task Target task.
+ * @param events Ready events.
+ */
+void worker_pool_submit(worker_task_t* task, int events);
+
+/**
+ * Waits until submitted tasks and tasks submitted by them are executed,
+ * then stops worker threads.
+ * Tasks submitted after that are never executed.
+ */
+void worker_pool_shutdown(void);
+
+#endif